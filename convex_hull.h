@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.h"
+#include "voronoi_structs.h"
+
+// Выпуклая оболочка «разделяй и властвуй» (Киркпатрик) на узлах HullNodes; её же слияние использует сборка диаграммы Вороного.
+// Точки отсортированы по x, затем по y; узел - номер точки в массиве, оболочка половины [begin, end) начинается с узла begin.
+// orient - предикат поворота, по умолчанию точный Point::orientation
+
+using Orientation = int (*)(const Point*, const Point*, const Point*);
+
+template < typename P, Orientation orient = Point::orientation >
+std::pair< uint32_t, uint32_t > findRightChain(const std::vector< P* >& points, const HullNodes& hull, uint32_t p, uint32_t right) {
+	const std::vector< uint32_t >& next = hull.next;
+	const std::vector< uint32_t >& prev = hull.prev;
+	if (right == next[right]) return std::make_pair(right, right);
+	if (next[right] == prev[right]) {
+		return orient(points[p], points[right], points[next[right]]) < 0
+			? std::make_pair(next[right], right)
+			: std::make_pair(right, next[right]);
+	}
+	const uint32_t NONE = UINT32_MAX;
+	uint32_t current = right;
+	std::pair< uint32_t, uint32_t > chain{ NONE, NONE };
+	while (chain.first == NONE || chain.second == NONE) {
+		int prev_orient = orient(points[p], points[current], points[prev[current]]);
+		int next_orient = orient(points[p], points[current], points[next[current]]);
+
+		if (chain.first == NONE && prev_orient > 0 && next_orient >= 0)
+			chain.first = current;
+
+		if (chain.second == NONE && prev_orient <= 0 && next_orient < 0)
+			chain.second = current;
+
+		current = next[current];
+	}
+	return chain;
+}
+
+// Слияние оболочек left и right; m - стек потока, после слияния его содержимое не нужно.
+// Возвращает узел самой левой точки и верхний мост между половинами (его концы нужны слиянию диаграмм)
+template < typename P, Orientation orient = Point::orientation >
+std::pair< uint32_t, std::pair< P*, P* > > mergeHulls(const std::vector< P* >& points, HullNodes& hull, uint32_t left, uint32_t right, std::vector< uint32_t >& m) {
+	std::vector< uint32_t >& next = hull.next;
+	std::vector< uint32_t >& prev = hull.prev;
+	const uint32_t NONE = UINT32_MAX;
+	auto chain = findRightChain< P, orient >(points, hull, left, right);
+	uint32_t l = next[left] == left ? NONE : next[left];
+	uint32_t r = chain.first;
+	m.clear();
+	size_t low = 0, up = 0;
+	m.emplace_back(left);
+	while (l != NONE || r != NONE) {
+		uint32_t curr;
+		bool rside = l == NONE || (r != NONE && orient(points[left], points[l], points[r]) < 0);
+		if (rside) {
+			curr = r;
+			r = r == chain.second ? NONE : next[r];
+		} else {
+			curr = l;
+			l = next[l] == left ? NONE : next[l];
+		}
+		while (m.size() >= 2 && orient(points[m[m.size() - 2]], points[m[m.size() - 1]], points[curr]) <= 0) {
+			m.pop_back();
+		}
+		if (next[m[m.size() - 1]] != curr) {
+			if (rside) {
+				low = m.size() - 1;
+			} else {
+				up = m.size() - 1;
+			}
+		}
+		m.emplace_back(curr);
+	}
+	if (m.size() > 2 && orient(points[m[m.size() - 2]], points[m[m.size() - 1]], points[m[0]]) <= 0) { // может быть только == 0
+		m.pop_back();
+	}
+	if (next[m[m.size() - 1]] != m[0]) {
+		up = m.size() - 1;
+	}
+	size_t up2 = (up + 1) % m.size();
+	std::pair< P*, P* > bridge = std::make_pair(points[m[up]], points[m[up2]]);
+	if (orient(points[m[up]], points[next[m[up]]], points[m[up2]]) == 0) {
+		bridge.first = points[next[m[up]]];
+	}
+	if (orient(points[m[up]], points[prev[m[up2]]], points[m[up2]]) == 0) {
+		bridge.second = points[prev[m[up2]]];
+	}
+	next[m[low]] = m[low + 1];
+	prev[m[low + 1]] = m[low];
+	next[m[up]] = m[up2];
+	prev[m[up2]] = m[up];
+	return std::make_pair(m[0], bridge); // left
+}
+
+// Оболочка точек [begin, end); hull должен вмещать end узлов
+template < typename P, Orientation orient = Point::orientation >
+uint32_t kirkpatrick(const std::vector< P* >& points, size_t begin, size_t end, HullNodes& hull, std::vector< uint32_t >& stack) {
+	if (end - begin == 1) {
+		return hull.makeNode(static_cast< uint32_t >(begin));
+	}
+	size_t mid = (begin + end) / 2;
+	auto left = kirkpatrick< P, orient >(points, begin, mid, hull, stack);
+	auto right = kirkpatrick< P, orient >(points, mid, end, hull, stack);
+	return mergeHulls< P, orient >(points, hull, left, right, stack).first;
+}
+
+// Параллельная версия: половины длиннее cutoff отдаются в пул; stacks - по стеку слияния на поток пула
+template < typename P, Orientation orient = Point::orientation >
+uint32_t kirkpatrick(const std::vector< P* >& points, size_t begin, size_t end, HullNodes& hull, std::vector< std::vector< uint32_t > >& stacks, ThreadPool& pool, size_t cutoff) {
+	if (end - begin <= std::max< size_t >(cutoff, 1)) {
+		return kirkpatrick< P, orient >(points, begin, end, hull, stacks[pool.workerIndex()]);
+	}
+	size_t mid = (begin + end) / 2;
+	uint32_t left = 0;
+	uint32_t right = 0;
+	pool.invoke([&] { left = kirkpatrick< P, orient >(points, begin, mid, hull, stacks, pool, cutoff); }, [&] { right = kirkpatrick< P, orient >(points, mid, end, hull, stacks, pool, cutoff); });
+	return mergeHulls< P, orient >(points, hull, left, right, stacks[pool.workerIndex()]).first;
+}
+
+// Копия points[0, count), отсортированная по x, затем по y, без повторов; index - номер точки во входе.
+// Копия, а не указатели на вход: сортировка и обход идут по памяти подряд
+inline std::vector< Point > sortedHullPoints(const Point* points, size_t count) {
+	std::vector< Point > sorted(points, points + count);
+	for (size_t i = 0; i < count; ++i) {
+		sorted[i].index = static_cast< uint32_t >(i);
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const Point& a, const Point& b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+	sorted.erase(std::unique(sorted.begin(), sorted.end(), [](const Point& a, const Point& b) { return a.x == b.x && a.y == b.y; }), sorted.end());
+	return sorted;
+}
+
+// Номера вершин выпуклой оболочки points[0, count) против часовой стрелки, начиная с самой левой (из них самой нижней) точки.
+// Точки на сторонах и повторы в оболочку не входят. С pool половины длиннее cutoff строятся параллельно
+inline std::vector< uint32_t > convexHull(const Point* points, size_t count, ThreadPool* pool = nullptr, size_t cutoff = 4096) {
+	std::vector< Point > sorted = sortedHullPoints(points, count);
+	std::vector< uint32_t > result;
+	if (sorted.empty()) return result;
+	std::vector< const Point* > nodes(sorted.size());
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		nodes[i] = &sorted[i];
+	}
+	HullNodes hull;
+	hull.reserve(nodes.size());
+	uint32_t first;
+	if (pool != nullptr) {
+		std::vector< std::vector< uint32_t > > stacks(pool->size());
+		first = kirkpatrick< const Point >(nodes, 0, nodes.size(), hull, stacks, *pool, cutoff);
+	} else {
+		std::vector< uint32_t > stack;
+		first = kirkpatrick< const Point >(nodes, 0, nodes.size(), hull, stack);
+	}
+	uint32_t node = first;
+	do {
+		result.push_back(sorted[node].index);
+		node = hull.next[node];
+	} while (node != first);
+	return result;
+}
+
+// Монотонная цепочка Эндрю - эталон для convexHull с тем же порядком и тем же предикатом
+inline std::vector< uint32_t > monotoneChainHull(const Point* points, size_t count) {
+	std::vector< Point > sorted = sortedHullPoints(points, count);
+	std::vector< uint32_t > result;
+	if (sorted.empty()) return result;
+	std::vector< const Point* > chain(2 * sorted.size());
+	size_t k = 0;
+	for (size_t i = 0; i < sorted.size(); ++i) { // нижняя цепочка слева направо
+		while (k >= 2 && Point::orientation(chain[k - 2], chain[k - 1], &sorted[i]) <= 0) --k;
+		chain[k++] = &sorted[i];
+	}
+	for (size_t i = sorted.size() - 1, lower = k + 1; i-- > 0;) { // верхняя справа налево
+		while (k >= lower && Point::orientation(chain[k - 2], chain[k - 1], &sorted[i]) <= 0) --k;
+		chain[k++] = &sorted[i];
+	}
+	for (size_t i = 0; i + 1 < std::max< size_t >(k, 2); ++i) { // последняя точка совпадает с первой
+		result.push_back(chain[i]->index);
+	}
+	return result;
+}
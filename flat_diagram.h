@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "voronoi_structs.h"
+
+// Готовая диаграмма в виде плоских массивов (structure of arrays).
+// Полуребра ячейки c лежат подряд в [cellEdges[c], cellEdges[c + 1]) в порядке обхода head -> next.
+class FlatDiagram {
+	public:
+		static constexpr uint32_t NONE = std::numeric_limits< uint32_t >::max();
+
+		// Конечные вершины
+		std::vector< double > vertexX, vertexY;
+
+		// Полуребра: начало (NONE для луча), двойник, следующее ребро ячейки, ячейка
+		std::vector< uint32_t > edgeOrigin, edgeTwin, edgeNext, edgeCell;
+
+		// Ячейки в порядке исходного вектора, смещения ребер в формате CSR
+		std::vector< double > cellX, cellY;
+		std::vector< int32_t > cellValue;
+		std::vector< uint32_t > cellEdges;
+
+		FlatDiagram() = default;
+
+		explicit FlatDiagram(const std::vector< Cell* >& cells) {
+			freeze(cells);
+		}
+
+		void freeze(const std::vector< Cell* >& cells) {
+			std::vector< HalfEdge* > edges;
+			edges.reserve(cells.size() * 6);
+			cellX.resize(cells.size());
+			cellY.resize(cells.size());
+			cellValue.resize(cells.size());
+			cellEdges.assign(1, 0);
+			cellEdges.reserve(cells.size() + 1);
+			for (size_t i = 0; i < cells.size(); ++i) {
+				cellX[i] = cells[i]->x;
+				cellY[i] = cells[i]->y;
+				cellValue[i] = cells[i]->value;
+				auto curr = cells[i]->head;
+				if (curr != nullptr) {
+					do {
+						edges.push_back(curr);
+						curr = curr->next;
+					} while (curr != cells[i]->head);
+				}
+				cellEdges.push_back(static_cast< uint32_t >(edges.size()));
+			}
+
+			PointerIndex edgeIds(edges.size()), vertexIds(edges.size());
+			for (uint32_t e = 0; e < edges.size(); ++e) {
+				edgeIds.insert(edges[e], e);
+			}
+
+			// Вершины нумеруются в порядке первого появления, чтобы результат не зависел от адресов
+			edgeOrigin.resize(edges.size());
+			edgeTwin.resize(edges.size());
+			edgeNext.resize(edges.size());
+			edgeCell.resize(edges.size());
+			vertexX.clear();
+			vertexY.clear();
+			for (uint32_t c = 0; c + 1 < cellEdges.size(); ++c) {
+				for (uint32_t e = cellEdges[c]; e < cellEdges[c + 1]; ++e) {
+					auto start = edges[e]->getStart();
+					edgeOrigin[e] = NONE;
+					if (start != nullptr) {
+						edgeOrigin[e] = vertexIds.insert(start, static_cast< uint32_t >(vertexX.size()));
+						if (edgeOrigin[e] == vertexX.size()) {
+							vertexX.push_back(start->x);
+							vertexY.push_back(start->y);
+						}
+					}
+					edgeTwin[e] = edgeIds.find(edges[e]->twin);
+					edgeNext[e] = e + 1 < cellEdges[c + 1] ? e + 1 : cellEdges[c];
+					edgeCell[e] = c;
+				}
+			}
+		}
+
+		size_t cellCount() const {
+			return cellEdges.empty() ? 0 : cellEdges.size() - 1;
+		}
+
+		size_t edgeCount() const {
+			return edgeOrigin.size();
+		}
+
+		// Конец ребра - начало двойника
+		uint32_t edgeEnd(uint32_t e) const {
+			return edgeTwin[e] == NONE ? NONE : edgeOrigin[edgeTwin[e]];
+		}
+
+		size_t bytes() const {
+			return (vertexX.size() + vertexY.size() + cellX.size() + cellY.size()) * sizeof(double)
+				+ (edgeOrigin.size() + edgeTwin.size() + edgeNext.size() + edgeCell.size() + cellEdges.size()) * sizeof(uint32_t)
+				+ cellValue.size() * sizeof(int32_t);
+		}
+
+	private:
+		// Указатель -> номер с открытой адресацией, на сотнях тысяч ребер заметно быстрее std::unordered_map
+		class PointerIndex {
+			public:
+				explicit PointerIndex(size_t count) {
+					while ((size_t(1) << bits) < 2 * count) ++bits;
+					slots.assign(size_t(1) << bits, { nullptr, NONE });
+				}
+
+				// Номер key; если его ещё нет, key получает value
+				uint32_t insert(const void* key, uint32_t value) {
+					size_t i = home(key);
+					while (slots[i].first != nullptr && slots[i].first != key) {
+						i = (i + 1) & (slots.size() - 1);
+					}
+					if (slots[i].first == nullptr) {
+						slots[i] = { key, value };
+					}
+					return slots[i].second;
+				}
+
+				uint32_t find(const void* key) const {
+					for (size_t i = home(key); slots[i].first != nullptr; i = (i + 1) & (slots.size() - 1)) {
+						if (slots[i].first == key) return slots[i].second;
+					}
+					return NONE;
+				}
+
+			private:
+				uint32_t bits = 4;
+				std::vector< std::pair< const void*, uint32_t > > slots;
+
+				size_t home(const void* key) const {
+					return (reinterpret_cast< uintptr_t >(key) * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+				}
+		};
+};
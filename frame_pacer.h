@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Темп кадров: FIFO - вертикальная синхронизация, поток рисования блокируется в present;
+// MAILBOX - без ожидания, лишние кадры заменяются в очереди показа;
+// TARGET_FPS - present не ждёт, поток спит до следующего дедлайна 1 / targetFps.
+class FramePacer {
+    public:
+        enum class Mode { FIFO, MAILBOX, TARGET_FPS };
+
+        explicit FramePacer(Mode mode = Mode::FIFO, double targetFps = 0) {
+            setMode(mode, targetFps);
+        }
+
+        void setMode(Mode mode, double targetFps = 0) {
+            if (mode == Mode::TARGET_FPS && targetFps <= 0) {
+                throw std::invalid_argument("Target FPS must be positive");
+            }
+            this->mode = mode;
+            this->targetFps = targetFps;
+            reset();
+        }
+
+        Mode getMode() const {
+            return mode;
+        }
+
+        static Mode parseMode(const std::string& name) {
+            if (name == "fifo") return Mode::FIFO;
+            if (name == "mailbox") return Mode::MAILBOX;
+            if (name == "fps") return Mode::TARGET_FPS;
+            throw std::invalid_argument("Unknown pacing mode: " + name);
+        }
+
+        // FIFO поддерживается всегда, поэтому он же запасной вариант
+        VkPresentModeKHR choosePresentMode(const std::vector< VkPresentModeKHR >& available) const {
+            auto has = [&](VkPresentModeKHR presentMode) {
+                return std::find(available.begin(), available.end(), presentMode) != available.end();
+            };
+            if (mode == Mode::MAILBOX && has(VK_PRESENT_MODE_MAILBOX_KHR)) {
+                return VK_PRESENT_MODE_MAILBOX_KHR;
+            }
+            if (mode == Mode::TARGET_FPS) {
+                if (has(VK_PRESENT_MODE_IMMEDIATE_KHR)) return VK_PRESENT_MODE_IMMEDIATE_KHR;
+                if (has(VK_PRESENT_MODE_MAILBOX_KHR)) return VK_PRESENT_MODE_MAILBOX_KHR;
+            }
+            return VK_PRESENT_MODE_FIFO_KHR;
+        }
+
+        // Отсчёт дедлайнов заново, например после свёрнутого окна
+        void reset() {
+            deadline = Clock::now();
+        }
+
+        // Вызывается после каждого кадра; в TARGET_FPS спит до дедлайна, дедлайны идут с шагом периода без накопления ошибки
+        void wait() {
+            if (mode != Mode::TARGET_FPS) return;
+            auto period = std::chrono::duration_cast< Clock::duration >(std::chrono::duration< double >(1 / targetFps));
+            deadline += period;
+            auto now = Clock::now();
+            if (deadline + period < now) { // отстали больше чем на кадр - не догоняем серией кадров без пауз
+                deadline = now;
+                return;
+            }
+            std::this_thread::sleep_until(deadline);
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        Mode mode = Mode::FIFO;
+        double targetFps = 0;
+        Clock::time_point deadline = Clock::now();
+};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Профилировщик кадра: CPU-время фаз drawFrame через RAII-таймеры и GPU-время render pass из timestamp queries.
+// Хранит последние WINDOW кадров в кольцевом буфере, по ним считаются перцентили и выгружаются CSV / Chrome trace.
+class FrameProfiler {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        enum Phase : uint32_t { FENCE_WAIT, ACQUIRE, UPDATE, STREAM, CULL, RECORD, SUBMIT, PRESENT, GPU, PHASE_COUNT };
+
+        static constexpr size_t WINDOW = 4096;
+
+        class Scope {
+            public:
+                Scope(FrameProfiler& profiler, Phase phase) : profiler(profiler), phase(phase), start(Clock::now()) {}
+
+                ~Scope() {
+                    profiler.record(phase, start, Clock::now());
+                }
+
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+
+            private:
+                FrameProfiler& profiler;
+                Phase phase;
+                Clock::time_point start;
+        };
+
+        // Начинает новый кадр, возвращает его номер (нужен, чтобы позже дописать GPU-время)
+        uint64_t beginFrame() {
+            Frame& frame = frames[frameCount % WINDOW];
+            frame.index = frameCount;
+            frame.startUs.fill(-1);
+            frame.ms.fill(-1);
+            frame.triangles = 0;
+            return frameCount++;
+        }
+
+        Scope scope(Phase phase) {
+            return Scope(*this, phase);
+        }
+
+        void record(Phase phase, Clock::time_point start, Clock::time_point end) {
+            if (frameCount == 0) return;
+            Frame& frame = frames[(frameCount - 1) % WINDOW];
+            frame.startUs[phase] = std::chrono::duration< double, std::micro >(start - origin).count();
+            frame.ms[phase] = std::chrono::duration< double, std::milli >(end - start).count();
+        }
+
+        // Сколько треугольников отправлено на отрисовку в текущем кадре
+        void setTriangles(uint64_t triangles) {
+            if (frameCount > 0) frames[(frameCount - 1) % WINDOW].triangles = triangles;
+        }
+
+        // GPU-время приходит на MAX_FRAMES_IN_FLIGHT кадров позже; вытесненные из окна кадры пропускаются
+        void setGpuTime(uint64_t index, double ms) {
+            if (index < frameCount && frameCount - index <= WINDOW) {
+                frames[index % WINDOW].ms[GPU] = ms;
+            }
+        }
+
+        size_t size() const {
+            return std::min< uint64_t >(frameCount, WINDOW);
+        }
+
+        // Перцентиль p (0..100) фазы по окну; кадры без этой фазы не учитываются
+        double percentile(Phase phase, double p) const {
+            std::vector< double > values;
+            values.reserve(size());
+            for (size_t i = 0; i < size(); ++i) {
+                if (frames[i].ms[phase] >= 0) values.push_back(frames[i].ms[phase]);
+            }
+            if (values.empty()) return 0;
+            size_t k = std::min(values.size() - 1, static_cast< size_t >(p / 100 * values.size()));
+            std::nth_element(values.begin(), values.begin() + k, values.end());
+            return values[k];
+        }
+
+        // Одна строка: фаза p50/p95/p99 в мс
+        void report(std::ostream& out) const {
+            for (uint32_t phase = 0; phase < PHASE_COUNT; ++phase) {
+                Phase p = static_cast< Phase >(phase);
+                out << (phase == 0 ? "" : ", ") << NAMES[phase] << " " << percentile(p, 50) << "/" << percentile(p, 95) << "/" << percentile(p, 99);
+            }
+            out << " ms (p50/p95/p99)";
+        }
+
+        void writeCsv(std::ostream& out) const {
+            out << "frame";
+            for (const char* name : NAMES) out << "," << name << "_ms";
+            out << ",triangles\n";
+            forEachFrame([&](const Frame& frame) {
+                out << frame.index;
+                for (double ms : frame.ms) {
+                    out << ",";
+                    if (ms >= 0) out << ms;
+                }
+                out << "," << frame.triangles << "\n";
+            });
+        }
+
+        // Формат Trace Event (chrome://tracing, Perfetto): CPU-фазы - интервалы, GPU-время - счётчик,
+        // потому что метки GPU идут в своей временной шкале
+        void writeTrace(std::ostream& out) const {
+            out << "{\"traceEvents\":[";
+            bool first = true;
+            forEachFrame([&](const Frame& frame) {
+                for (uint32_t phase = 0; phase < GPU; ++phase) {
+                    if (frame.ms[phase] < 0) continue;
+                    out << (first ? "" : ",") << "\n{\"name\":\"" << NAMES[phase] << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << frame.startUs[phase]
+                        << ",\"dur\":" << frame.ms[phase] * 1000 << ",\"args\":{\"frame\":" << frame.index << "}}";
+                    first = false;
+                }
+                if (frame.ms[GPU] >= 0 && frame.startUs[SUBMIT] >= 0) {
+                    out << (first ? "" : ",") << "\n{\"name\":\"gpu_ms\",\"ph\":\"C\",\"pid\":0,\"tid\":0,\"ts\":" << frame.startUs[SUBMIT]
+                        << ",\"args\":{\"gpu\":" << frame.ms[GPU] << "}}";
+                    first = false;
+                }
+            });
+            out << "\n]}\n";
+        }
+
+        void writeCsv(const std::string& path) const {
+            std::ofstream file = open(path);
+            writeCsv(file);
+        }
+
+        void writeTrace(const std::string& path) const {
+            std::ofstream file = open(path);
+            writeTrace(file);
+        }
+
+    private:
+        static constexpr const char* NAMES[PHASE_COUNT] = { "fence_wait", "acquire", "update", "stream", "cull", "record", "submit", "present", "gpu" };
+
+        struct Frame {
+            uint64_t index = 0;
+            std::array< double, PHASE_COUNT > startUs; // от origin, -1 если фазы не было
+            std::array< double, PHASE_COUNT > ms;
+            uint64_t triangles = 0;
+        };
+
+        Clock::time_point origin = Clock::now();
+        std::vector< Frame > frames = std::vector< Frame >(WINDOW);
+        uint64_t frameCount = 0;
+
+        // Кадры окна от старого к новому
+        template < typename F >
+        void forEachFrame(const F& func) const {
+            for (uint64_t i = frameCount - size(); i < frameCount; ++i) {
+                func(frames[i % WINDOW]);
+            }
+        }
+
+        static std::ofstream open(const std::string& path) {
+            std::ofstream file(path);
+            if (!file.is_open()) {
+                throw std::runtime_error("Failed to open " + path);
+            }
+            return file;
+        }
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <array>
+
+// Пирамида видимости из матрицы clip = projection * view * model (Gribb, Hartmann): плоскости в координатах модели.
+// Ближняя плоскость берётся в соглашении OpenGL (-w <= z), для Vulkan это лишь чуть более консервативная проверка.
+class Frustum {
+    public:
+        explicit Frustum(const glm::mat4& clip) {
+            glm::vec4 rows[4];
+            for (int i = 0; i < 4; ++i) {
+                rows[i] = glm::vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+            }
+            planes = { rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2] };
+        }
+
+        // false, только если AABB целиком снаружи одной из плоскостей
+        bool intersects(const glm::vec3& min, const glm::vec3& max) const {
+            for (const glm::vec4& plane : planes) {
+                glm::vec3 farthest(plane.x > 0 ? max.x : min.x, plane.y > 0 ? max.y : min.y, plane.z > 0 ? max.z : min.z);
+                if (plane.x * farthest.x + plane.y * farthest.y + plane.z * farthest.z + plane.w < 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        std::array< glm::vec4, 6 > planes;
+};
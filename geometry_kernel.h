@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "voronoi_structs.h"
+
+// Ядро геометрии сборки диаграммы по типу координат сайтов: знаки поворота и вписанности и вершина шва -
+// центр окружности через сайты шва и соседа по ребру. Определены ядра для double и int64_t
+template < typename Coord >
+struct GeometryKernel;
+
+__extension__ typedef __int128 Int128; // GCC и Clang
+
+// Любые сайты: адаптивные предикаты predicates.h, вершина - пересечение шва с прямой ребра
+template <>
+struct GeometryKernel< double > {
+	static int orientation(const Point* a, const Point* b, const Point* c) {
+		return Point::orientation(a, b, c);
+	}
+
+	static int incircle(const Point* a, const Point* b, const Point* c, const Point* d) {
+		return Point::incircle(a, b, c, d);
+	}
+
+	static std::optional< Point > seamVertex(HalfEdge* edge, const Line& seam, const Point*) {
+		return edge->getLine().intersection(seam);
+	}
+};
+
+// Целые сайты с размахом по x и по y не больше SPAN (карта, зеркала LOD, плитки потока вдали от нуля). Ядро считает только
+// разности сайтов, поэтому важен размах, а не сами координаты: разности до 2^17, поворот до 2^35 в int64_t,
+// слагаемые incircle до 2^70 в __int128, числители центра окружности до 2^53 - точны и в int64_t, и в double.
+// Знаки точные без фильтра и запасного пути, в double переводится только готовая вершина
+template <>
+struct GeometryKernel< int64_t > {
+	static constexpr double SPAN = 131072; // 2^17
+	static constexpr double MAX_COORD = 4611686018427387904.0; // 2^62, координата влезает в int64_t
+
+	static int64_t coord(double v) {
+		return static_cast< int64_t >(v);
+	}
+
+	static int64_t cross(int64_t ax, int64_t ay, int64_t bx, int64_t by) {
+		return ax * by - ay * bx;
+	}
+
+	static bool accepts(const std::vector< Cell* >& cells, size_t begin, size_t end) {
+		if (begin >= end) return true;
+		double minX = cells[begin]->x, maxX = minX, minY = cells[begin]->y, maxY = minY;
+		for (size_t i = begin; i < end; ++i) {
+			const Cell* cell = cells[i];
+			if (std::trunc(cell->x) != cell->x || std::trunc(cell->y) != cell->y) return false; // и NaN
+			minX = std::min(minX, cell->x);
+			maxX = std::max(maxX, cell->x);
+			minY = std::min(minY, cell->y);
+			maxY = std::max(maxY, cell->y);
+		}
+		// бесконечность даёт размах inf или NaN, и проверка не проходит
+		return maxX - minX <= SPAN && maxY - minY <= SPAN && std::abs(minX) <= MAX_COORD && std::abs(minY) <= MAX_COORD;
+	}
+
+	static int orientation(const Point* a, const Point* b, const Point* c) {
+		int64_t det = cross(coord(b->x) - coord(a->x), coord(b->y) - coord(a->y), coord(c->x) - coord(a->x), coord(c->y) - coord(a->y));
+		return (det > 0) - (det < 0);
+	}
+
+	static int incircle(const Point* a, const Point* b, const Point* c, const Point* d) {
+		int64_t adx = coord(a->x) - coord(d->x), ady = coord(a->y) - coord(d->y);
+		int64_t bdx = coord(b->x) - coord(d->x), bdy = coord(b->y) - coord(d->y);
+		int64_t cdx = coord(c->x) - coord(d->x), cdy = coord(c->y) - coord(d->y);
+		Int128 det = static_cast< Int128 >(adx * adx + ady * ady) * cross(bdx, bdy, cdx, cdy)
+			+ static_cast< Int128 >(bdx * bdx + bdy * bdy) * cross(cdx, cdy, adx, ady)
+			+ static_cast< Int128 >(cdx * cdx + cdy * cdy) * cross(adx, ady, bdx, bdy);
+		return (det > 0) - (det < 0);
+	}
+
+	// Центр окружности через edge->cell, other и edge->twin->cell по самим сайтам, а не по округлённым вершинам ребра;
+	// nullopt, если три сайта на одной прямой (шов параллелен ребру)
+	static std::optional< Point > seamVertex(HalfEdge* edge, const Line&, const Point* other) {
+		const Point* origin = edge->cell;
+		const Point* neighbor = edge->twin->cell;
+		int64_t rx = coord(other->x) - coord(origin->x), ry = coord(other->y) - coord(origin->y);
+		int64_t nx = coord(neighbor->x) - coord(origin->x), ny = coord(neighbor->y) - coord(origin->y);
+		int64_t den = 2 * cross(rx, ry, nx, ny);
+		if (den == 0) return std::nullopt;
+		int64_t r2 = rx * rx + ry * ry, n2 = nx * nx + ny * ny;
+		return Point(origin->x + static_cast< double >(r2 * ny - n2 * ry) / den, origin->y + static_cast< double >(n2 * rx - r2 * nx) / den);
+	}
+};
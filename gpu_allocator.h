@@ -0,0 +1,234 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+// Участок блока памяти под один буфер или изображение
+struct GpuAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr; // адрес начала участка, если память HOST_VISIBLE (блок отображён постоянно)
+    uint32_t pool = 0;
+    uint32_t block = 0;
+};
+
+// Подраспределитель памяти GPU: vkAllocateMemory вызывается на блок BLOCK_SIZE, а буферы и изображения получают из него участки.
+// Для каждого типа памяти два пула - линейные ресурсы (буферы) и оптимальные изображения, чтобы не учитывать bufferImageGranularity.
+// Свободные участки блока хранятся упорядоченно по смещению, выбирается первый подходящий с учётом выравнивания,
+// освобождённый сливается с соседями. Ресурс больше половины блока получает собственный блок, который освобождается вместе с ним.
+class GpuAllocator {
+    public:
+        static constexpr VkDeviceSize BLOCK_SIZE = 64ull << 20;
+
+        struct Stats {
+            uint32_t blocks = 0;
+            uint32_t allocations = 0;
+            uint32_t freeRanges = 0;
+            VkDeviceSize reserved = 0; // сумма размеров блоков
+            VkDeviceSize used = 0;
+            VkDeviceSize largestFree = 0;
+        };
+
+        void init(VkDevice device, VkPhysicalDevice physicalDevice) {
+            this->device = device;
+            vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+            pools.assign(memProperties.memoryTypeCount * 2, {});
+        }
+
+        // Пустое выделение (memory == VK_NULL_HANDLE), если подходящего типа памяти нет или все подходящие кучи исчерпаны
+        GpuAllocation tryAllocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear) {
+            for (uint32_t type = 0; type < memProperties.memoryTypeCount; ++type) {
+                if (!(requirements.memoryTypeBits & (1u << type)) || (memProperties.memoryTypes[type].propertyFlags & properties) != properties) {
+                    continue;
+                }
+                uint32_t poolIndex = type * 2 + (linear ? 1 : 0);
+                Pool& pool = pools[poolIndex];
+                bool dedicated = requirements.size > BLOCK_SIZE / 2;
+                if (!dedicated) {
+                    for (uint32_t k = 0; k < pool.blocks.size(); ++k) {
+                        VkDeviceSize offset;
+                        if (pool.blocks[k].memory != VK_NULL_HANDLE && !pool.blocks[k].dedicated && take(pool.blocks[k], requirements, offset)) {
+                            return makeAllocation(poolIndex, k, offset, requirements.size);
+                        }
+                    }
+                }
+                uint32_t k = addBlock(type, pool, dedicated ? requirements.size : BLOCK_SIZE, dedicated);
+                if (k == UINT32_MAX) {
+                    continue; // куча этого типа кончилась, пробуем следующий подходящий
+                }
+                VkDeviceSize offset;
+                take(pool.blocks[k], requirements, offset);
+                return makeAllocation(poolIndex, k, offset, requirements.size);
+            }
+            return {};
+        }
+
+        GpuAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear) {
+            GpuAllocation result = tryAllocate(requirements, properties, linear);
+            if (result.memory == VK_NULL_HANDLE) {
+                throw std::runtime_error("Failed to allocate GPU memory!");
+            }
+            return result;
+        }
+
+        void free(GpuAllocation& allocation) {
+            if (allocation.memory == VK_NULL_HANDLE) return;
+            Block& block = pools[allocation.pool].blocks[allocation.block];
+            --block.allocations;
+            if (block.dedicated) {
+                release(block);
+            } else {
+                auto inserted = block.freeRanges.emplace(allocation.offset, allocation.size).first;
+                auto after = std::next(inserted);
+                if (after != block.freeRanges.end() && inserted->first + inserted->second == after->first) {
+                    inserted->second += after->second;
+                    block.freeRanges.erase(after);
+                }
+                if (inserted != block.freeRanges.begin()) {
+                    auto before = std::prev(inserted);
+                    if (before->first + before->second == inserted->first) {
+                        before->second += inserted->second;
+                        block.freeRanges.erase(inserted);
+                    }
+                }
+            }
+            allocation = {};
+        }
+
+        // Возвращает драйверу целиком свободные блоки; живые участки не переносятся. Возвращает число освобождённых блоков
+        uint32_t trim() {
+            uint32_t released = 0;
+            for (Pool& pool : pools) {
+                for (Block& block : pool.blocks) {
+                    if (block.memory != VK_NULL_HANDLE && block.allocations == 0) {
+                        release(block);
+                        ++released;
+                    }
+                }
+            }
+            return released;
+        }
+
+        Stats stats() const {
+            Stats result;
+            for (const Pool& pool : pools) {
+                for (const Block& block : pool.blocks) {
+                    if (block.memory == VK_NULL_HANDLE) continue;
+                    ++result.blocks;
+                    result.allocations += block.allocations;
+                    result.reserved += block.size;
+                    VkDeviceSize free = 0;
+                    for (const auto& range : block.freeRanges) {
+                        free += range.second;
+                        result.largestFree = std::max(result.largestFree, range.second);
+                    }
+                    result.freeRanges += static_cast< uint32_t >(block.freeRanges.size());
+                    result.used += block.size - free;
+                }
+            }
+            return result;
+        }
+
+        void print(std::ostream& out) const {
+            Stats s = stats();
+            out << "gpu memory: " << s.allocations << " allocations in " << s.blocks << " blocks, " << s.used / 1024 << " KB used of " << s.reserved / 1024
+                << " KB reserved, " << s.freeRanges << " free ranges, largest " << s.largestFree / 1024 << " KB" << std::endl;
+        }
+
+        void destroy() {
+            for (Pool& pool : pools) {
+                for (Block& block : pool.blocks) {
+                    release(block);
+                }
+            }
+            pools.clear();
+        }
+
+    private:
+        struct Block {
+            VkDeviceMemory memory = VK_NULL_HANDLE;
+            VkDeviceSize size = 0;
+            uint8_t* mapped = nullptr;
+            bool dedicated = false;
+            uint32_t allocations = 0;
+            std::map< VkDeviceSize, VkDeviceSize > freeRanges; // смещение -> размер
+        };
+
+        // Номера блоков стабильны: освобождённый блок остаётся пустым местом в векторе и занимается следующим
+        struct Pool {
+            std::vector< Block > blocks;
+        };
+
+        VkDevice device = VK_NULL_HANDLE;
+        VkPhysicalDeviceMemoryProperties memProperties{};
+        std::vector< Pool > pools; // [тип памяти * 2 + линейный]
+
+        // Первый свободный участок, в который помещается ресурс после выравнивания начала; остатки слева и справа остаются свободными
+        static bool take(Block& block, const VkMemoryRequirements& requirements, VkDeviceSize& offset) {
+            VkDeviceSize alignment = std::max< VkDeviceSize >(requirements.alignment, 1);
+            for (auto range = block.freeRanges.begin(); range != block.freeRanges.end(); ++range) {
+                VkDeviceSize begin = range->first, end = range->first + range->second;
+                VkDeviceSize aligned = (begin + alignment - 1) / alignment * alignment;
+                if (aligned + requirements.size > end) continue;
+                block.freeRanges.erase(range);
+                if (aligned > begin) {
+                    block.freeRanges.emplace(begin, aligned - begin);
+                }
+                if (aligned + requirements.size < end) {
+                    block.freeRanges.emplace(aligned + requirements.size, end - aligned - requirements.size);
+                }
+                offset = aligned;
+                ++block.allocations;
+                return true;
+            }
+            return false;
+        }
+
+        uint32_t addBlock(uint32_t type, Pool& pool, VkDeviceSize size, bool dedicated) {
+            VkMemoryAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = size;
+            allocInfo.memoryTypeIndex = type;
+            Block block;
+            if (vkAllocateMemory(device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS) {
+                return UINT32_MAX;
+            }
+            if (memProperties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+                void* mapped;
+                vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+                block.mapped = static_cast< uint8_t* >(mapped);
+            }
+            block.size = size;
+            block.dedicated = dedicated;
+            block.freeRanges.emplace(0, size);
+            for (uint32_t k = 0; k < pool.blocks.size(); ++k) {
+                if (pool.blocks[k].memory == VK_NULL_HANDLE) {
+                    pool.blocks[k] = std::move(block);
+                    return k;
+                }
+            }
+            pool.blocks.push_back(std::move(block));
+            return static_cast< uint32_t >(pool.blocks.size() - 1);
+        }
+
+        void release(Block& block) {
+            if (block.memory == VK_NULL_HANDLE) return;
+            if (block.mapped != nullptr) {
+                vkUnmapMemory(device, block.memory);
+            }
+            vkFreeMemory(device, block.memory, nullptr);
+            block = {};
+        }
+
+        GpuAllocation makeAllocation(uint32_t pool, uint32_t block, VkDeviceSize offset, VkDeviceSize size) const {
+            const Block& source = pools[pool].blocks[block];
+            return { source.memory, offset, size, source.mapped != nullptr ? source.mapped + offset : nullptr, pool, block };
+        }
+};
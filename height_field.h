@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "perlin_noise_2d.h"
+#include "thread_pool.h"
+
+// Запечённая карта высот: noise(x, y, octaves) в узлах сетки с шагом 1 / resolution в координатах шума,
+// между узлами билинейная интерполяция, за пределами сетки берётся ближайший край.
+class HeightField {
+    public:
+        // Сетка покрывает [originX, originX + width] x [originY, originY + height]; строки считаются пакетно, с пулом - параллельно
+        void build(PerlinNoise2D& perlin, float width, float height, uint32_t resolution, int32_t octaves, ThreadPool* pool = nullptr, float originX = 0, float originY = 0) {
+            this->resolution = static_cast< float >(resolution);
+            this->originX = originX;
+            this->originY = originY;
+            columns = static_cast< uint32_t >(std::ceil(width * resolution)) + 1;
+            rows = static_cast< uint32_t >(std::ceil(height * resolution)) + 1;
+            values.resize(static_cast< size_t >(columns) * rows);
+            std::vector< float > rowX(columns);
+            for (uint32_t i = 0; i < columns; ++i) {
+                rowX[i] = originX + i / this->resolution;
+            }
+            auto buildRows = [&](size_t from, size_t to) {
+                std::vector< float > rowY(columns);
+                for (size_t j = from; j < to; ++j) {
+                    std::fill(rowY.begin(), rowY.end(), originY + j / this->resolution);
+                    perlin.noiseBatch(rowX.data(), rowY.data(), values.data() + j * columns, columns, octaves);
+                }
+            };
+            if (pool != nullptr) {
+                pool->parallelFor(0, rows, 16, buildRows);
+            } else {
+                buildRows(0, rows);
+            }
+        }
+
+        float sample(float x, float y) const {
+            float fx = std::min(std::max((x - originX) * resolution, 0.0f), static_cast< float >(columns - 1));
+            float fy = std::min(std::max((y - originY) * resolution, 0.0f), static_cast< float >(rows - 1));
+            uint32_t i = std::min(static_cast< uint32_t >(fx), columns - 2), j = std::min(static_cast< uint32_t >(fy), rows - 2);
+            float tx = fx - i, ty = fy - j;
+            const float* top = values.data() + static_cast< size_t >(j) * columns + i;
+            const float* bottom = top + columns;
+            float upper = top[0] + tx * (top[1] - top[0]);
+            float lower = bottom[0] + tx * (bottom[1] - bottom[0]);
+            return upper + ty * (lower - upper);
+        }
+
+        bool empty() const {
+            return values.empty();
+        }
+
+        uint32_t getColumns() const {
+            return columns;
+        }
+
+        uint32_t getRows() const {
+            return rows;
+        }
+
+        size_t bytes() const {
+            return values.size() * sizeof(float);
+        }
+
+    private:
+        uint32_t columns = 0, rows = 0;
+        float resolution = 1;
+        float originX = 0, originY = 0;
+        std::vector< float > values;
+};
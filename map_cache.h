@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "flat_diagram.h"
+#include "map_tile.h"
+#include "vulkan_engine.h"
+
+// Файл только для чтения, отображённый в память; без POSIX читается целиком
+class MappedFile {
+    public:
+        MappedFile() = default;
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            close();
+        }
+
+        bool open(const std::string& path) {
+            close();
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* mapped = mmap(nullptr, static_cast< size_t >(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    bytes = static_cast< const uint8_t* >(mapped);
+                    length = static_cast< size_t >(info.st_size);
+                }
+            }
+            ::close(fd);
+            return bytes != nullptr;
+#else
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file.is_open()) return false;
+            buffer.resize(static_cast< size_t >(file.tellg()));
+            file.seekg(0);
+            file.read(reinterpret_cast< char* >(buffer.data()), buffer.size());
+            bytes = buffer.data();
+            length = buffer.size();
+            return !buffer.empty();
+#endif
+        }
+
+        void close() {
+#ifndef _WIN32
+            if (bytes != nullptr) {
+                munmap(const_cast< uint8_t* >(bytes), length);
+            }
+#else
+            buffer.clear();
+#endif
+            bytes = nullptr;
+            length = 0;
+        }
+
+        const uint8_t* data() const {
+            return bytes;
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+    private:
+        const uint8_t* bytes = nullptr;
+        size_t length = 0;
+#ifdef _WIN32
+        std::vector< uint8_t > buffer;
+#endif
+};
+
+// Кэш построенной карты: итоговые буферы вершин (сразу в формате GpuVertex) и индексов, чанки и плоская диаграмма.
+// Ключ - seed, размер карты, версия генератора и опции, меняющие сетку; он входит в имя файла и повторяется в заголовке.
+// Повторный запуск отображает файл в память, и движок загружает буферы прямо из него.
+class MapCache {
+    public:
+        // Увеличивать при любом изменении генерации (смещения, диаграмма, сетка, модели) - старые файлы перестанут подходить
+        static constexpr uint32_t GENERATOR_VERSION = 1;
+
+        enum Flags : uint32_t { SHARED_VERTICES = 1, LOD = 2 };
+
+        MapCache(const std::string& directory, int32_t seed, uint32_t flags) : directory(directory) {
+            header.seed = seed;
+            header.flags = flags;
+        }
+
+        std::string path() const {
+            return directory + "/map_" + std::to_string(header.seed) + "_" + std::to_string(MAP_WIDTH) + "x" + std::to_string(MAP_HEIGHT)
+                + "_v" + std::to_string(GENERATOR_VERSION) + "_f" + std::to_string(header.flags) + "_" + std::to_string(sizeof(GpuVertex)) + ".bin";
+        }
+
+        // true, если файл есть, заголовок совпал с ключом и размер сходится с количествами из заголовка
+        bool load() {
+            if (!file.open(path()) || file.size() < sizeof(Header)) return false;
+            Header stored;
+            std::memcpy(&stored, file.data(), sizeof(Header));
+            if (std::memcmp(stored.magic, header.magic, sizeof(header.magic)) != 0 || stored.version != header.version || stored.seed != header.seed
+                || stored.width != header.width || stored.height != header.height || stored.regionSize != header.regionSize || stored.flags != header.flags
+                || stored.vertexSize != header.vertexSize || stored.chunkSize != header.chunkSize) {
+                file.close();
+                return false;
+            }
+            header = stored;
+            if (file.size() != sectionOffset(SECTION_COUNT)) {
+                file.close();
+                return false;
+            }
+            return true;
+        }
+
+        GpuGeometry geometry() const {
+            return { section< GpuVertex >(VERTICES), header.counts[VERTICES], section< uint32_t >(INDICES), header.counts[INDICES] };
+        }
+
+        std::vector< TerrainChunk > chunks() const {
+            const TerrainChunk* data = section< TerrainChunk >(CHUNKS);
+            return std::vector< TerrainChunk >(data, data + header.counts[CHUNKS]);
+        }
+
+        FlatDiagram diagram() const {
+            FlatDiagram diagram;
+            copy(CELL_X, diagram.cellX);
+            copy(CELL_Y, diagram.cellY);
+            copy(CELL_VALUE, diagram.cellValue);
+            copy(CELL_EDGES, diagram.cellEdges);
+            copy(EDGE_ORIGIN, diagram.edgeOrigin);
+            copy(EDGE_TWIN, diagram.edgeTwin);
+            copy(EDGE_NEXT, diagram.edgeNext);
+            copy(EDGE_CELL, diagram.edgeCell);
+            copy(VERTEX_X, diagram.vertexX);
+            copy(VERTEX_Y, diagram.vertexY);
+            return diagram;
+        }
+
+        size_t bytes() const {
+            return file.size();
+        }
+
+        // Пишет во временный файл и переименовывает, чтобы параллельный запуск не прочитал недописанный
+        void save(const std::vector< Vertex >& vertices, const std::vector< uint32_t >& indices, const std::vector< TerrainChunk >& chunks, const FlatDiagram& diagram) {
+#ifdef PACKED_VERTEX
+            std::vector< GpuVertex > gpuVertices(vertices.size());
+            for (size_t i = 0; i < vertices.size(); ++i) {
+                gpuVertices[i] = PackedVertex::pack(vertices[i]);
+            }
+#else
+            const std::vector< GpuVertex >& gpuVertices = vertices;
+#endif
+            std::vector< std::pair< const void*, size_t > > sections(SECTION_COUNT);
+            auto add = [&](Section section, const auto& values) {
+                header.counts[section] = values.size();
+                sections[section] = { values.data(), values.size() * sizeof(values[0]) };
+            };
+            add(VERTICES, gpuVertices);
+            add(INDICES, indices);
+            add(CHUNKS, chunks);
+            add(CELL_X, diagram.cellX);
+            add(CELL_Y, diagram.cellY);
+            add(CELL_VALUE, diagram.cellValue);
+            add(CELL_EDGES, diagram.cellEdges);
+            add(EDGE_ORIGIN, diagram.edgeOrigin);
+            add(EDGE_TWIN, diagram.edgeTwin);
+            add(EDGE_NEXT, diagram.edgeNext);
+            add(EDGE_CELL, diagram.edgeCell);
+            add(VERTEX_X, diagram.vertexX);
+            add(VERTEX_Y, diagram.vertexY);
+
+            std::filesystem::create_directories(directory);
+            std::string temporary = path() + ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::binary);
+                if (!out.is_open()) {
+                    throw std::runtime_error("Failed to open " + temporary);
+                }
+                out.write(reinterpret_cast< const char* >(&header), sizeof(Header));
+                const char padding[ALIGNMENT] = {};
+                for (uint32_t section = 0; section < SECTION_COUNT; ++section) {
+                    out.write(padding, sectionOffset(section) - static_cast< size_t >(out.tellp()));
+                    out.write(static_cast< const char* >(sections[section].first), sections[section].second);
+                }
+                if (!out) {
+                    throw std::runtime_error("Failed to write " + temporary);
+                }
+            }
+            std::filesystem::rename(temporary, path());
+        }
+
+    private:
+        enum Section : uint32_t {
+            VERTICES, INDICES, CHUNKS, CELL_X, CELL_Y, CELL_VALUE, CELL_EDGES, EDGE_ORIGIN, EDGE_TWIN, EDGE_NEXT, EDGE_CELL, VERTEX_X, VERTEX_Y, SECTION_COUNT
+        };
+
+        static constexpr size_t ALIGNMENT = 16;
+
+        // Размеры элементов секций в порядке Section
+        static constexpr size_t ELEMENT_SIZE[SECTION_COUNT] = {
+            sizeof(GpuVertex), sizeof(uint32_t), sizeof(TerrainChunk), sizeof(double), sizeof(double), sizeof(int32_t),
+            sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(double), sizeof(double)
+        };
+
+        struct Header {
+            char magic[4] = { 'V', 'M', 'A', 'P' };
+            uint32_t version = GENERATOR_VERSION;
+            int32_t seed = 0;
+            uint32_t width = MAP_WIDTH, height = MAP_HEIGHT, regionSize = REGION_SIZE;
+            uint32_t flags = 0;
+            uint32_t vertexSize = sizeof(GpuVertex), chunkSize = sizeof(TerrainChunk);
+            uint64_t counts[SECTION_COUNT] = {};
+        };
+
+        std::string directory;
+        Header header;
+        MappedFile file;
+
+        // Секции идут после заголовка подряд, каждая выровнена на ALIGNMENT; sectionOffset(SECTION_COUNT) - размер файла
+        size_t sectionOffset(uint32_t section) const {
+            size_t offset = sizeof(Header);
+            for (uint32_t k = 0; k < section; ++k) {
+                offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT + header.counts[k] * ELEMENT_SIZE[k];
+            }
+            return section == SECTION_COUNT ? offset : (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        }
+
+        template < typename T >
+        const T* section(Section section) const {
+            return reinterpret_cast< const T* >(file.data() + sectionOffset(section));
+        }
+
+        template < typename T >
+        void copy(Section from, std::vector< T >& to) const {
+            const T* data = section< T >(from);
+            to.assign(data, data + header.counts[from]);
+        }
+};
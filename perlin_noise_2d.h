@@ -1,12 +1,24 @@
 #pragma once
 
 #include <iostream>
+#include <algorithm>
 #include <cmath>
 #include <ctime>
 #include <random>
 #include <fstream>
+#include <vector>
 #include <glm/glm.hpp>
 
+#if defined(__x86_64__) || defined(_M_X64)
+    #include <immintrin.h>
+    #define PERLIN_X86 1
+#endif
+#if defined(__GNUC__)
+    #define PERLIN_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define PERLIN_TARGET_AVX2
+#endif
+
 #include "map_tile.h"
 
 class PerlinNoise2D {
@@ -42,7 +54,13 @@ class PerlinNoise2D {
             for (const auto& b : bmpHeaders) {
                 image << b;
             }
+            std::vector< float > rowX(width), rowY(width), rowNoise(width);
+            for (uint32_t x = 0; x < width; ++x) {
+                rowX[x] = x / res;
+            }
             for (uint32_t y = 0; y < height; ++y) {
+                std::fill(rowY.begin(), rowY.end(), y / res);
+                noiseBatch(rowX.data(), rowY.data(), rowNoise.data(), width, octaves);
                 for (uint32_t x = 0; x < width; ++x) {
 
                     // uint8_t color = static_cast< uint8_t >(round(255 * noiseVal));
@@ -51,7 +69,7 @@ class PerlinNoise2D {
                     //     image << static_cast< uint8_t >(0) << static_cast< uint8_t >(0) << static_cast< uint8_t >(255);
                     // } else 
 
-                    glm::vec3 color = MapTile::getColor(MapTile::getTile(noise(x / res, y / res, octaves)));
+                    glm::vec3 color = MapTile::getColor(MapTile::getTile(rowNoise[x]));
                     image << static_cast<uint8_t>(round(255 * color.b)) << static_cast<uint8_t>(round(255 * color.g)) << static_cast<uint8_t>(round(255 * color.r));
                 }
                 for (uint32_t i = 0; i < padSize; ++i) {
@@ -64,10 +82,64 @@ class PerlinNoise2D {
         PerlinNoise2D(uint32_t seed = time(0)) : SEED(seed) {
             std::default_random_engine engine(SEED);
             std::uniform_int_distribution< uint32_t > distribution(0, 359);
-            hash.reserve(HASH_SIZE); 
+            hash.reserve(HASH_SIZE + 360);
             for (size_t i = 0; i < HASH_SIZE; ++i) {   
                 hash.emplace_back(distribution(engine));
             }
+            for (size_t i = HASH_SIZE; i < HASH_SIZE + 360; ++i) {
+                hash.emplace_back(hash[i % HASH_SIZE]);
+            }
+            seedOffset = SEED % HASH_SIZE;
+            for (uint32_t angle = 0; angle < 360; ++angle) {
+                float rad = M_PI * angle / 180;
+                gradientX[angle] = cos(rad);
+                gradientY[angle] = sin(rad);
+            }
+            kernel = bestKernel();
+        }
+
+        enum class Kernel { SCALAR, SSE2, AVX2 };
+
+        // Лучшее ядро пакетного шума для текущего процессора
+        static Kernel bestKernel() {
+#if defined(PERLIN_X86) && defined(__GNUC__)
+            if (__builtin_cpu_supports("avx2")) {
+                return Kernel::AVX2;
+            }
+#endif
+#if defined(PERLIN_X86)
+            return Kernel::SSE2;
+#else
+            return Kernel::SCALAR;
+#endif
+        }
+
+        Kernel getKernel() const {
+            return kernel;
+        }
+
+        // Для сравнения ядер в бенчмарке; ядро должно поддерживаться процессором
+        void setKernel(Kernel value) {
+            kernel = value;
+        }
+
+        // Допустимое расхождение noiseBatch и noise. На x86-64 ядра повторяют скалярные операции в том же порядке
+        // (без FMA, с тем же финальным пересчётом в double) и совпадают побитно, допуск оставлен для других компиляторов.
+        static constexpr float BATCH_TOLERANCE = 1e-6f;
+
+        // out[i] = noise(x[i], y[i], octaves, persistence); координаты, как и у noise, неотрицательные
+        void noiseBatch(const float* x, const float* y, float* out, size_t count, int32_t octaves = 1, float persistence = 0.5f) {
+            size_t done = 0;
+#if defined(PERLIN_X86)
+            if (kernel == Kernel::AVX2) {
+                done = noiseAvx2(x, y, out, count, octaves, persistence);
+            } else if (kernel == Kernel::SSE2) {
+                done = noiseSse2(x, y, out, count, octaves, persistence);
+            }
+#endif
+            for (size_t i = done; i < count; ++i) {
+                out[i] = noise(x[i], y[i], octaves, persistence);
+            }
         }
 
         // возвращает значение шума [0, 1]
@@ -95,12 +167,123 @@ class PerlinNoise2D {
 
     private:
         const uint64_t SEED;
-        const size_t HASH_SIZE = 256;
+        const size_t HASH_SIZE = 256; // степень двойки, индексы берутся по маске
+        // HASH_SIZE случайных углов и их повтор ещё на 360 элементов: индекс (x & 255) + угол не выходит за таблицу без %
         std::vector< uint32_t > hash;
+        uint32_t seedOffset;
+        // Единичные градиенты для всех 360 углов
+        float gradientX[360], gradientY[360];
+        Kernel kernel = Kernel::SCALAR;
+
+#if defined(PERLIN_X86)
+        // 4 точки за шаг, без gather: индексы градиентов считаются поштучно
+        size_t noiseSse2(const float* x, const float* y, float* out, size_t count, int32_t octaves, float persistence) {
+            const __m128 one = _mm_set1_ps(1), two = _mm_set1_ps(2), three = _mm_set1_ps(3);
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), result = _mm_setzero_ps();
+                float amplitude = 1, max = 0;
+                for (int32_t octave = 0; octave < octaves; ++octave) {
+                    max += amplitude;
+                    __m128i left = floorSse2(vx), top = floorSse2(vy);
+                    __m128 lx = _mm_sub_ps(vx, _mm_cvtepi32_ps(left)), ly = _mm_sub_ps(vy, _mm_cvtepi32_ps(top));
+                    alignas(16) uint32_t l[4], t[4];
+                    alignas(16) float g[8][4];
+                    _mm_store_si128(reinterpret_cast< __m128i* >(l), left);
+                    _mm_store_si128(reinterpret_cast< __m128i* >(t), top);
+                    for (int k = 0; k < 4; ++k) {
+                        uint32_t left = l[k] & (HASH_SIZE - 1), right = (l[k] + 1) & (HASH_SIZE - 1);
+                        uint32_t h0 = hash[(t[k] & (HASH_SIZE - 1)) + seedOffset], h1 = hash[((t[k] + 1) & (HASH_SIZE - 1)) + seedOffset];
+                        uint32_t a = hash[left + h0], b = hash[right + h0], c = hash[left + h1], d = hash[right + h1];
+                        g[0][k] = gradientX[a]; g[1][k] = gradientY[a];
+                        g[2][k] = gradientX[b]; g[3][k] = gradientY[b];
+                        g[4][k] = gradientX[c]; g[5][k] = gradientY[c];
+                        g[6][k] = gradientX[d]; g[7][k] = gradientY[d];
+                    }
+                    __m128 rx = _mm_sub_ps(lx, one), by = _mm_sub_ps(ly, one);
+                    __m128 tls = _mm_add_ps(_mm_mul_ps(_mm_load_ps(g[0]), lx), _mm_mul_ps(_mm_load_ps(g[1]), ly));
+                    __m128 trs = _mm_add_ps(_mm_mul_ps(_mm_load_ps(g[2]), rx), _mm_mul_ps(_mm_load_ps(g[3]), ly));
+                    __m128 bls = _mm_add_ps(_mm_mul_ps(_mm_load_ps(g[4]), lx), _mm_mul_ps(_mm_load_ps(g[5]), by));
+                    __m128 brs = _mm_add_ps(_mm_mul_ps(_mm_load_ps(g[6]), rx), _mm_mul_ps(_mm_load_ps(g[7]), by));
+                    __m128 sx = _mm_mul_ps(_mm_mul_ps(lx, lx), _mm_sub_ps(three, _mm_mul_ps(two, lx)));
+                    __m128 sy = _mm_mul_ps(_mm_mul_ps(ly, ly), _mm_sub_ps(three, _mm_mul_ps(two, ly)));
+                    __m128 top2 = _mm_add_ps(tls, _mm_mul_ps(sx, _mm_sub_ps(trs, tls)));
+                    __m128 bottom = _mm_add_ps(bls, _mm_mul_ps(sx, _mm_sub_ps(brs, bls)));
+                    __m128 value = _mm_add_ps(top2, _mm_mul_ps(sy, _mm_sub_ps(bottom, top2)));
+                    result = _mm_add_ps(result, _mm_mul_ps(value, _mm_set1_ps(amplitude)));
+                    amplitude *= persistence;
+                    vx = _mm_mul_ps(vx, two);
+                    vy = _mm_mul_ps(vy, two);
+                }
+                result = _mm_div_ps(result, _mm_set1_ps(max));
+                __m128d low = normalizeSse2(_mm_cvtps_pd(result)), high = normalizeSse2(_mm_cvtps_pd(_mm_movehl_ps(result, result)));
+                _mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(low), _mm_cvtpd_ps(high)));
+            }
+            return i;
+        }
+
+        static __m128i floorSse2(__m128 v) {
+            __m128i truncated = _mm_cvttps_epi32(v);
+            __m128 greater = _mm_cmpgt_ps(_mm_cvtepi32_ps(truncated), v);
+            return _mm_add_epi32(truncated, _mm_castps_si128(greater)); // -1 там, где отрицательное округлилось вверх
+        }
+
+        static __m128d normalizeSse2(__m128d v) {
+            v = _mm_add_pd(_mm_div_pd(v, _mm_set1_pd(sqrt(2))), _mm_set1_pd(0.5));
+            return _mm_min_pd(_mm_max_pd(v, _mm_setzero_pd()), _mm_set1_pd(1.0));
+        }
+
+        // 8 точек за шаг, индексы и градиенты собираются через gather
+        PERLIN_TARGET_AVX2 size_t noiseAvx2(const float* x, const float* y, float* out, size_t count, int32_t octaves, float persistence) {
+            const __m256 one = _mm256_set1_ps(1), two = _mm256_set1_ps(2), three = _mm256_set1_ps(3);
+            const __m256i mask = _mm256_set1_epi32(static_cast< int32_t >(HASH_SIZE - 1)), seed = _mm256_set1_epi32(static_cast< int32_t >(seedOffset)), next = _mm256_set1_epi32(1);
+            const int* table = reinterpret_cast< const int* >(hash.data());
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i), result = _mm256_setzero_ps();
+                float amplitude = 1, max = 0;
+                for (int32_t octave = 0; octave < octaves; ++octave) {
+                    max += amplitude;
+                    __m256 fx = _mm256_floor_ps(vx), fy = _mm256_floor_ps(vy);
+                    __m256i left = _mm256_cvttps_epi32(fx), top = _mm256_cvttps_epi32(fy);
+                    __m256 lx = _mm256_sub_ps(vx, fx), ly = _mm256_sub_ps(vy, fy);
+                    __m256i h0 = _mm256_i32gather_epi32(table, _mm256_add_epi32(_mm256_and_si256(top, mask), seed), 4);
+                    __m256i h1 = _mm256_i32gather_epi32(table, _mm256_add_epi32(_mm256_and_si256(_mm256_add_epi32(top, next), mask), seed), 4);
+                    __m256i right = _mm256_and_si256(_mm256_add_epi32(left, next), mask);
+                    left = _mm256_and_si256(left, mask);
+                    __m256i a = _mm256_i32gather_epi32(table, _mm256_add_epi32(left, h0), 4);
+                    __m256i b = _mm256_i32gather_epi32(table, _mm256_add_epi32(right, h0), 4);
+                    __m256i c = _mm256_i32gather_epi32(table, _mm256_add_epi32(left, h1), 4);
+                    __m256i d = _mm256_i32gather_epi32(table, _mm256_add_epi32(right, h1), 4);
+                    __m256 rx = _mm256_sub_ps(lx, one), by = _mm256_sub_ps(ly, one);
+                    __m256 tls = _mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(gradientX, a, 4), lx), _mm256_mul_ps(_mm256_i32gather_ps(gradientY, a, 4), ly));
+                    __m256 trs = _mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(gradientX, b, 4), rx), _mm256_mul_ps(_mm256_i32gather_ps(gradientY, b, 4), ly));
+                    __m256 bls = _mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(gradientX, c, 4), lx), _mm256_mul_ps(_mm256_i32gather_ps(gradientY, c, 4), by));
+                    __m256 brs = _mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(gradientX, d, 4), rx), _mm256_mul_ps(_mm256_i32gather_ps(gradientY, d, 4), by));
+                    __m256 sx = _mm256_mul_ps(_mm256_mul_ps(lx, lx), _mm256_sub_ps(three, _mm256_mul_ps(two, lx)));
+                    __m256 sy = _mm256_mul_ps(_mm256_mul_ps(ly, ly), _mm256_sub_ps(three, _mm256_mul_ps(two, ly)));
+                    __m256 top2 = _mm256_add_ps(tls, _mm256_mul_ps(sx, _mm256_sub_ps(trs, tls)));
+                    __m256 bottom = _mm256_add_ps(bls, _mm256_mul_ps(sx, _mm256_sub_ps(brs, bls)));
+                    __m256 value = _mm256_add_ps(top2, _mm256_mul_ps(sy, _mm256_sub_ps(bottom, top2)));
+                    result = _mm256_add_ps(result, _mm256_mul_ps(value, _mm256_set1_ps(amplitude)));
+                    amplitude *= persistence;
+                    vx = _mm256_mul_ps(vx, two);
+                    vy = _mm256_mul_ps(vy, two);
+                }
+                result = _mm256_div_ps(result, _mm256_set1_ps(max));
+                const __m256d sqrt2 = _mm256_set1_pd(sqrt(2)), half = _mm256_set1_pd(0.5), zero = _mm256_setzero_pd(), unit = _mm256_set1_pd(1.0);
+                __m256d low = _mm256_cvtps_pd(_mm256_castps256_ps128(result)), high = _mm256_cvtps_pd(_mm256_extractf128_ps(result, 1));
+                low = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_div_pd(low, sqrt2), half), zero), unit);
+                high = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_div_pd(high, sqrt2), half), zero), unit);
+                _mm256_storeu_ps(out + i, _mm256_set_m128(_mm256_cvtpd_ps(high), _mm256_cvtpd_ps(low)));
+            }
+            return i;
+        }
+#endif
 
         glm::vec2 getPseudorandomVector(uint32_t x, uint32_t y) {
-            float rad = M_PI * hash[(x + hash[(y + SEED) % HASH_SIZE]) % HASH_SIZE] / 180;
-            return glm::vec2(cos(rad), sin(rad));
+            uint32_t angle = hash[(x & (HASH_SIZE - 1)) + hash[(y & (HASH_SIZE - 1)) + seedOffset]];
+            return glm::vec2(gradientX[angle], gradientY[angle]);
         }
 
         float smoothstep(float t) {
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+// Точные знаки поворота и вписанности по схеме Шевчука: сначала детерминант в double с априорной оценкой погрешности,
+// если знак под сомнением - точное значение как сумма неперекрывающихся чисел double (разложение), знак берётся у старшего.
+
+// a + b = x + y точно
+inline void twoSum(double a, double b, double& x, double& y) {
+	x = a + b;
+	double bVirtual = x - a;
+	double aVirtual = x - bVirtual;
+	y = (a - aVirtual) + (b - bVirtual);
+}
+
+// a * b = x + y точно
+inline void twoProduct(double a, double b, double& x, double& y) {
+	x = a * b;
+	y = std::fma(a, b, -x);
+}
+
+// Прибавляет b к разложению e длины length (по возрастанию модулей, без нулей); возвращает новую длину
+inline int growExpansion(double* e, int length, double b) {
+	double q = b;
+	int count = 0;
+	for (int i = 0; i < length; ++i) {
+		double sum, error;
+		twoSum(q, e[i], sum, error);
+		q = sum;
+		if (error != 0) {
+			e[count++] = error;
+		}
+	}
+	if (q != 0 || count == 0) {
+		e[count++] = q;
+	}
+	return count;
+}
+
+// Знак ax * by - ax * cy - ay * bx + ay * cx + bx * cy - by * cx без округлений
+inline int orient2dExact(double ax, double ay, double bx, double by, double cx, double cy) {
+	const double factors[6][2] = { { ax, by }, { -ax, cy }, { -ay, bx }, { ay, cx }, { bx, cy }, { -by, cx } };
+	double expansion[13];
+	int length = 0;
+	for (const auto& factor : factors) {
+		double product, error;
+		twoProduct(factor[0], factor[1], product, error);
+		length = growExpansion(expansion, length, error);
+		length = growExpansion(expansion, length, product);
+	}
+	double top = expansion[length - 1];
+	return top < 0 ? -1 : (top > 0 ? 1 : 0);
+}
+
+// 1 - c левее ab (против часовой), -1 - правее, 0 - точно на прямой.
+// Оценка та же, что у Шевчука, но через |left| + |right| без ветвлений по знакам: у случайных точек знаки непредсказуемы,
+// а единственная проверка «знак надёжен» почти всегда истинна. При разных знаках слагаемых вычитание без сокращения, и проверка
+// проходит; оба нулевых произведения точны (разность округляется в ноль только равных чисел), тогда детерминант точно 0
+inline int orient2d(double ax, double ay, double bx, double by, double cx, double cy) {
+	const double epsilon = 0x1p-53;
+	const double errorBound = (3.0 + 16.0 * epsilon) * epsilon;
+	double left = (ax - cx) * (by - cy);
+	double right = (ay - cy) * (bx - cx);
+	double det = left - right;
+	double bound = errorBound * (std::abs(left) + std::abs(right));
+	if (std::abs(det) > bound || (left == 0 && right == 0)) {
+		return (det > 0) - (det < 0);
+	}
+	return orient2dExact(ax, ay, bx, by, cx, cy);
+}
+
+// Разложение произвольной длины для точного пути incircle; по возрастанию модулей
+using Expansion = std::vector< double >;
+
+inline Expansion expansionSum(const Expansion& e, const Expansion& f) {
+	Expansion result = e;
+	for (double v : f) {
+		result.emplace_back(0.0);
+		result.resize(growExpansion(result.data(), static_cast< int >(result.size()) - 1, v));
+	}
+	return result;
+}
+
+inline Expansion expansionProduct(const Expansion& e, const Expansion& f) {
+	Expansion result;
+	for (double a : e) {
+		for (double b : f) {
+			double product, error;
+			twoProduct(a, b, product, error);
+			result.resize(result.size() + 2);
+			int length = growExpansion(result.data(), static_cast< int >(result.size()) - 2, error);
+			result.resize(growExpansion(result.data(), length, product));
+		}
+	}
+	return result;
+}
+
+// a - b точно, два слагаемых
+inline Expansion expansionDiff(double a, double b) {
+	double x, y;
+	twoSum(a, -b, x, y);
+	return y != 0 ? Expansion{ y, x } : Expansion{ x };
+}
+
+inline int expansionSign(const Expansion& e) {
+	double top = e.empty() ? 0 : e.back();
+	return top < 0 ? -1 : (top > 0 ? 1 : 0);
+}
+
+inline int incircleExact(double ax, double ay, double bx, double by, double cx, double cy, double dx, double dy) {
+	const Expansion adx = expansionDiff(ax, dx), ady = expansionDiff(ay, dy);
+	const Expansion bdx = expansionDiff(bx, dx), bdy = expansionDiff(by, dy);
+	const Expansion cdx = expansionDiff(cx, dx), cdy = expansionDiff(cy, dy);
+	auto lift = [](const Expansion& x, const Expansion& y) { return expansionSum(expansionProduct(x, x), expansionProduct(y, y)); };
+	auto cross = [](const Expansion& x1, const Expansion& y1, const Expansion& x2, const Expansion& y2) {
+		Expansion minus = expansionProduct(y1, x2);
+		for (double& v : minus) v = -v;
+		return expansionSum(expansionProduct(x1, y2), minus);
+	};
+	Expansion det = expansionProduct(lift(adx, ady), cross(bdx, bdy, cdx, cdy));
+	det = expansionSum(det, expansionProduct(lift(bdx, bdy), cross(cdx, cdy, adx, ady)));
+	det = expansionSum(det, expansionProduct(lift(cdx, cdy), cross(adx, ady, bdx, bdy)));
+	return expansionSign(det);
+}
+
+// 1 - d внутри окружности через a, b, c (обходящие её против часовой), -1 - снаружи, 0 - точно на ней
+inline int incircle(double ax, double ay, double bx, double by, double cx, double cy, double dx, double dy) {
+	const double epsilon = 0x1p-53;
+	const double errorBound = (10.0 + 96.0 * epsilon) * epsilon;
+	double adx = ax - dx, ady = ay - dy, bdx = bx - dx, bdy = by - dy, cdx = cx - dx, cdy = cy - dy;
+	double bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+	double cdxady = cdx * ady, adxcdy = adx * cdy;
+	double adxbdy = adx * bdy, bdxady = bdx * ady;
+	double alift = adx * adx + ady * ady;
+	double blift = bdx * bdx + bdy * bdy;
+	double clift = cdx * cdx + cdy * cdy;
+	double det = alift * (bdxcdy - cdxbdy) + blift * (cdxady - adxcdy) + clift * (adxbdy - bdxady);
+	double permanent = (std::abs(bdxcdy) + std::abs(cdxbdy)) * alift + (std::abs(cdxady) + std::abs(adxcdy)) * blift + (std::abs(adxbdy) + std::abs(bdxady)) * clift;
+	if (std::abs(det) > errorBound * permanent) {
+		return (det > 0) - (det < 0);
+	}
+	return incircleExact(ax, ay, bx, by, cx, cy, dx, dy);
+}
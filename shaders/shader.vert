@@ -8,10 +8,30 @@ layout(set = 0, binding = 0) uniform Matrices {
     mat4 finishModel;
 } ubo;
 
+#ifdef PACKED_VERTEX
+// PackedVertex из vulkan_engine.h
+const float POSITION_SCALE = 4.0;
+const vec3 PALETTE[8] = vec3[](
+    vec3(0.0, 0.74, 1.0), vec3(0.87, 0.76, 0.58), vec3(0.2, 0.6, 0.2), vec3(0.2549, 0.2784, 0.2901), vec3(1.0, 1.0, 1.0),
+    vec3(1.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0), vec3(0.0, 0.0, 1.0)
+);
+
+layout(location = 0) in vec4 vPackedPosition;
+layout(location = 1) in uvec4 vInfo; // палитра, объект, маска outline
+layout(location = 2) in vec2 vPackedNormal;
+
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));
+    return n;
+}
+#else
 layout(location = 0) in vec4 vPosition;
 layout(location = 1) in vec3 vColor;
 layout(location = 2) in vec3 vNormal;
 layout(location = 3) in vec3 vOutline;
+#endif
 
 layout(location = 0) out vec3 color;
 layout(location = 1) out vec3 position;
@@ -20,6 +40,12 @@ layout(location = 3) noperspective out vec3 outline;
 
 
 void main() {
+#ifdef PACKED_VERTEX
+    vec4 vPosition = vec4(vPackedPosition.xyz * POSITION_SCALE, float(vInfo.y));
+    vec3 vColor = PALETTE[vInfo.x];
+    vec3 vNormal = octDecode(vPackedNormal);
+    vec3 vOutline = vec3(uvec3(vInfo.z, vInfo.z >> 1, vInfo.z >> 2) & 1u);
+#endif
     color = vColor;
     position = vec3(ubo.mv * vec4(vPosition.xyz, 1.0));
     normal = normalize(mat3(ubo.normal) * vNormal);
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "thread_pool.h"
+#include "voronoi_structs.h"
+
+// Упорядочивание сайтов перед voronoi(): по x, затем по y.
+// Координаты переводятся в 64-битные ключи с тем же порядком, что у double, и сортируются поразрядно (LSD, разряд 11 бит):
+// сначала разряды y, затем x, каждый проход устойчив. Проходы, где у всех ключей разряд одинаков, пропускаются -
+// у целых координат карты младшие биты мантиссы нулевые, и остаётся по 2-3 прохода на координату.
+// Для x, различающихся больше чем на EPS, порядок совпадает с прежней сортировкой через fuzzyCompare
+
+// Ключ с порядком double: у положительных взводится знаковый бит, у отрицательных инвертируются все биты; -0 сводится к +0
+inline uint64_t siteKey(double value) {
+	value += 0.0;
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	return (bits >> 63) != 0 ? ~bits : bits | (1ull << 63);
+}
+
+// Сортирует cells и убирает повторы - сайты, совпадающие с предыдущим с точностью fuzzyEquals (остаётся первый из них).
+// Повтор сломал бы слияние диаграмм, а ячейка без сайта просто отходит соседу. Возвращает число убранных
+inline size_t orderSites(std::vector< Cell* >& cells, ThreadPool& pool) {
+	struct Entry {
+		uint64_t x, y;
+		Cell* cell;
+	};
+	const size_t n = cells.size();
+	if (n < 2) return 0;
+	const size_t GRAIN = 1 << 14;
+	const uint32_t BITS = 11, BUCKETS = 1u << BITS, DIGITS = (64 + BITS - 1) / BITS; // разрядов на ключ
+	const size_t chunks = std::max< size_t >(1, std::min< size_t >(pool.size() * 4, (n + GRAIN - 1) / GRAIN));
+	const size_t chunkSize = (n + chunks - 1) / chunks;
+	auto forChunks = [&](const auto& func) {
+		pool.parallelFor(0, chunks, 1, [&](size_t from, size_t to) {
+			for (size_t c = from; c < to; ++c) {
+				func(c, std::min(n, c * chunkSize), std::min(n, (c + 1) * chunkSize));
+			}
+		});
+	};
+
+	std::vector< Entry > entries(n), buffer(n);
+	std::vector< uint64_t > changedX(chunks), changedY(chunks); // биты, в которых ключи куска отличаются от ключа первого сайта
+	const uint64_t firstX = siteKey(cells[0]->x), firstY = siteKey(cells[0]->y);
+	forChunks([&](size_t c, size_t from, size_t to) {
+		uint64_t dx = 0, dy = 0;
+		for (size_t i = from; i < to; ++i) {
+			entries[i] = { siteKey(cells[i]->x), siteKey(cells[i]->y), cells[i] };
+			dx |= entries[i].x ^ firstX;
+			dy |= entries[i].y ^ firstY;
+		}
+		changedX[c] = dx;
+		changedY[c] = dy;
+	});
+	uint64_t changed[2] = { 0, 0 }; // y, x
+	for (size_t c = 0; c < chunks; ++c) {
+		changed[0] |= changedY[c];
+		changed[1] |= changedX[c];
+	}
+
+	std::vector< size_t > offsets(chunks * BUCKETS); // [кусок * BUCKETS + разряд]
+	for (uint32_t pass = 0; pass < 2 * DIGITS; ++pass) {
+		const bool byX = pass >= DIGITS;
+		const uint32_t shift = pass % DIGITS * BITS;
+		if (((changed[byX] >> shift) & (BUCKETS - 1)) == 0) continue;
+		auto digit = [&](const Entry& e) {
+			return static_cast< uint32_t >(((byX ? e.x : e.y) >> shift) & (BUCKETS - 1));
+		};
+		forChunks([&](size_t c, size_t from, size_t to) {
+			size_t* count = &offsets[c * BUCKETS];
+			std::fill(count, count + BUCKETS, 0);
+			for (size_t i = from; i < to; ++i) {
+				++count[digit(entries[i])];
+			}
+		});
+		size_t offset = 0;
+		for (uint32_t d = 0; d < BUCKETS; ++d) {
+			for (size_t c = 0; c < chunks; ++c) {
+				size_t count = offsets[c * BUCKETS + d];
+				offsets[c * BUCKETS + d] = offset;
+				offset += count;
+			}
+		}
+		forChunks([&](size_t c, size_t from, size_t to) {
+			size_t* offset = &offsets[c * BUCKETS];
+			for (size_t i = from; i < to; ++i) {
+				buffer[offset[digit(entries[i])]++] = entries[i];
+			}
+		});
+		entries.swap(buffer);
+	}
+
+	size_t kept = 0;
+	for (const Entry& entry : entries) {
+		if (kept > 0 && cells[kept - 1]->fuzzyEquals(entry.cell)) continue;
+		cells[kept++] = entry.cell;
+	}
+	cells.resize(kept);
+	return n - kept;
+}
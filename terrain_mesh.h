@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "flat_diagram.h"
+#include "map_tile.h"
+#include "perlin_noise_2d.h"
+#include "thread_pool.h"
+#include "vulkan_engine.h"
+
+// Сетка рельефа: веер треугольников (центр ячейки, начало ребра, конец ребра) на каждую ячейку с value != 0.
+// Ячейки обрабатываются блоками параллельно, нормали общих вершин складываются в порядке обхода ячеек,
+// поэтому результат побайтно совпадает с последовательным построением.
+// В режиме shared копии вершины диаграммы с одинаковым цветом сливаются в одну, треугольники ссылаются на неё по индексу.
+// Индексы сгруппированы по чанкам из CHUNK_REGIONS x CHUNK_REGIONS регионов, у каждого чанка свой AABB для отсечения.
+class TerrainMesh {
+	public:
+		static constexpr uint32_t CHUNK_REGIONS = 16;
+		static constexpr float SKIRT_DEPTH = 0.05f;
+
+		std::vector< Vertex > vertices;
+		std::vector< uint32_t > indices;
+		std::vector< TerrainChunk > chunks;
+
+		void build(const FlatDiagram& diagram, const std::vector< MapTile::Type >& tiles, PerlinNoise2D& perlin, ThreadPool& pool, bool shared = false, size_t block = 1024) {
+			size_t cellCount = diagram.cellCount();
+
+			// Сколько вершин и треугольников даст каждая ячейка, затем префиксные суммы:
+			// вершины идут в порядке ячеек, треугольники - в порядке чанков, внутри чанка в порядке ячеек
+			std::vector< uint32_t > vertexOffset(cellCount + 1, 0), triangleCount(cellCount, 0), triangleOffset(cellCount), cellChunk(cellCount);
+			pool.parallelFor(0, cellCount, block, [&](size_t from, size_t to) {
+				for (size_t c = from; c < to; ++c) {
+					cellChunk[c] = chunkOf(diagram.cellX[c], diagram.cellY[c]);
+					if (diagram.cellValue[c] == 0) continue;
+					uint32_t triangles = 0;
+					for (uint32_t e = diagram.cellEdges[c]; e < diagram.cellEdges[c + 1]; ++e) {
+						triangles += isTriangle(diagram, e);
+					}
+					triangleCount[c] = triangles;
+					vertexOffset[c + 1] = 1 + 2 * triangles;
+				}
+			});
+			std::vector< uint32_t > chunkOffset(CHUNKS_X * CHUNKS_Y + 1, 0);
+			for (size_t c = 0; c < cellCount; ++c) {
+				vertexOffset[c + 1] += vertexOffset[c];
+				chunkOffset[cellChunk[c] + 1] += triangleCount[c];
+			}
+			for (size_t k = 0; k + 1 < chunkOffset.size(); ++k) {
+				chunkOffset[k + 1] += chunkOffset[k];
+			}
+			std::vector< uint32_t > chunkFill(chunkOffset.begin(), chunkOffset.end() - 1);
+			for (size_t c = 0; c < cellCount; ++c) {
+				triangleOffset[c] = chunkFill[cellChunk[c]];
+				chunkFill[cellChunk[c]] += triangleCount[c];
+			}
+			vertices.resize(vertexOffset[cellCount]);
+			indices.resize(3 * static_cast< size_t >(chunkOffset.back()));
+			slotVertex.assign(vertices.size(), FlatDiagram::NONE);
+
+			// Вершины и нормали граней; нормаль грани пока лежит в normal вершин b и c
+			pool.parallelFor(0, cellCount, block, [&](size_t from, size_t to) {
+				for (size_t c = from; c < to; ++c) {
+					if (diagram.cellValue[c] != 0) {
+						buildCell(diagram, tiles, perlin, c, vertexOffset[c], 3 * static_cast< size_t >(triangleOffset[c]));
+					}
+				}
+			});
+
+			// Для каждой общей вершины - её копии в порядке возрастания номера (CSR)
+			std::vector< uint32_t > copyOffset(diagram.vertexX.size() + 1, 0);
+			for (uint32_t v : slotVertex) {
+				if (v != FlatDiagram::NONE) ++copyOffset[v + 1];
+			}
+			for (size_t v = 0; v < diagram.vertexX.size(); ++v) {
+				copyOffset[v + 1] += copyOffset[v];
+			}
+			std::vector< uint32_t > copies(copyOffset.back()), fill(copyOffset.begin(), copyOffset.end() - 1);
+			for (uint32_t slot = 0; slot < slotVertex.size(); ++slot) {
+				if (slotVertex[slot] != FlatDiagram::NONE) copies[fill[slotVertex[slot]]++] = slot;
+			}
+
+			// Сумма нормалей граней в том же порядке, что и у последовательного обхода, записывается во все копии
+			pool.parallelFor(0, diagram.vertexX.size(), 16 * block, [&](size_t from, size_t to) {
+				for (size_t v = from; v < to; ++v) {
+					if (copyOffset[v] == copyOffset[v + 1]) continue;
+					glm::vec3 normal = vertices[copies[copyOffset[v]]].normal;
+					for (uint32_t k = copyOffset[v] + 1; k < copyOffset[v + 1]; ++k) {
+						normal += vertices[copies[k]].normal;
+					}
+					for (uint32_t k = copyOffset[v]; k < copyOffset[v + 1]; ++k) {
+						vertices[copies[k]].normal = normal;
+					}
+				}
+			});
+			if (shared) {
+				shareVertices(copyOffset, copies, pool, block);
+			}
+			slotVertex = std::vector< uint32_t >();
+			buildChunks(chunkOffset, pool);
+		}
+
+		// Для LOD: чанки всех уровней должны совпадать по границе, поэтому треугольники обрезаются по квадратам чанков,
+		// а вдоль внутренних сторон квадрата опускается юбка на SKIRT_DEPTH, закрывающая щели между уровнями разной высоты.
+		// После обрезки у каждого треугольника свои вершины, режим shared не сохраняется.
+		void clipToChunks(ThreadPool& pool, uint32_t lod, float error) {
+			// Треугольник попадает во все чанки, которые задевает его AABB
+			auto cellRange = [](float lo, float hi, uint32_t regions, uint32_t count) {
+				auto cell = [&](float v) {
+					return static_cast< uint32_t >(std::min(std::max((v + 1) / 2 * regions / CHUNK_REGIONS, 0.0f), count - 1.0f));
+				};
+				return std::make_pair(cell(lo), cell(hi));
+			};
+			size_t triangleCount = indices.size() / 3;
+			std::vector< std::vector< uint32_t > > bins(CHUNKS_X * CHUNKS_Y);
+			for (uint32_t t = 0; t < triangleCount; ++t) {
+				const glm::vec4& a = vertices[indices[3 * static_cast< size_t >(t)]].pos;
+				const glm::vec4& b = vertices[indices[3 * static_cast< size_t >(t) + 1]].pos;
+				const glm::vec4& c = vertices[indices[3 * static_cast< size_t >(t) + 2]].pos;
+				auto xs = cellRange(std::min({ a.x, b.x, c.x }), std::max({ a.x, b.x, c.x }), MAP_WIDTH, CHUNKS_X);
+				auto ys = cellRange(std::min({ a.y, b.y, c.y }), std::max({ a.y, b.y, c.y }), MAP_HEIGHT, CHUNKS_Y);
+				for (uint32_t cy = ys.first; cy <= ys.second; ++cy) {
+					for (uint32_t cx = xs.first; cx <= xs.second; ++cx) {
+						bins[cy * CHUNKS_X + cx].push_back(t);
+					}
+				}
+			}
+			std::vector< std::vector< Vertex > > clipped(bins.size());
+			pool.parallelFor(0, bins.size(), 1, [&](size_t from, size_t to) {
+				for (size_t k = from; k < to; ++k) {
+					clipChunk(bins[k], static_cast< uint32_t >(k % CHUNKS_X), static_cast< uint32_t >(k / CHUNKS_X), clipped[k]);
+				}
+			});
+
+			chunks.clear();
+			size_t total = 0;
+			for (size_t k = 0; k < clipped.size(); ++k) {
+				if (clipped[k].empty()) continue;
+				chunks.push_back({ static_cast< uint32_t >(total), static_cast< uint32_t >(clipped[k].size()), glm::vec3(0), glm::vec3(0), static_cast< uint32_t >(k), lod, error });
+				total += clipped[k].size();
+			}
+			vertices.resize(total);
+			indices.resize(total);
+			pool.parallelFor(0, chunks.size(), 1, [&](size_t from, size_t to) {
+				for (size_t k = from; k < to; ++k) {
+					TerrainChunk& chunk = chunks[k];
+					std::copy(clipped[chunk.grid].begin(), clipped[chunk.grid].end(), vertices.begin() + chunk.firstIndex);
+					for (uint32_t i = chunk.firstIndex; i < chunk.firstIndex + chunk.indexCount; ++i) {
+						indices[i] = i;
+					}
+					updateBounds(chunk);
+				}
+			});
+		}
+
+	private:
+		static constexpr uint32_t CHUNKS_X = (MAP_WIDTH + CHUNK_REGIONS - 1) / CHUNK_REGIONS;
+		static constexpr uint32_t CHUNKS_Y = (MAP_HEIGHT + CHUNK_REGIONS - 1) / CHUNK_REGIONS;
+
+		// Номер вершины диаграммы для каждой вершины сетки, NONE для центров ячеек
+		std::vector< uint32_t > slotVertex;
+
+		// Чанк по центру ячейки; ячейки за краем карты попадают в крайний чанк
+		static uint32_t chunkOf(double x, double y) {
+			auto clamp = [](double v, uint32_t count) {
+				return static_cast< uint32_t >(std::min(std::max(v / (CHUNK_REGIONS * REGION_SIZE), 0.0), count - 1.0));
+			};
+			return clamp(y, CHUNKS_Y) * CHUNKS_X + clamp(x, CHUNKS_X);
+		}
+
+		// Непустые чанки и их AABB по вершинам их треугольников
+		void buildChunks(const std::vector< uint32_t >& chunkOffset, ThreadPool& pool) {
+			chunks.clear();
+			for (size_t k = 0; k + 1 < chunkOffset.size(); ++k) {
+				if (chunkOffset[k] != chunkOffset[k + 1]) {
+					chunks.push_back({ 3 * chunkOffset[k], 3 * (chunkOffset[k + 1] - chunkOffset[k]), glm::vec3(0), glm::vec3(0), static_cast< uint32_t >(k) });
+				}
+			}
+			pool.parallelFor(0, chunks.size(), 1, [&](size_t from, size_t to) {
+				for (size_t k = from; k < to; ++k) {
+					updateBounds(chunks[k]);
+				}
+			});
+		}
+
+		void updateBounds(TerrainChunk& chunk) const {
+			const glm::vec4& first = vertices[indices[chunk.firstIndex]].pos;
+			chunk.min = chunk.max = glm::vec3(first.x, first.y, first.z);
+			for (uint32_t i = chunk.firstIndex; i < chunk.firstIndex + chunk.indexCount; ++i) {
+				const glm::vec4& pos = vertices[indices[i]].pos;
+				chunk.min = glm::vec3(std::min(chunk.min.x, pos.x), std::min(chunk.min.y, pos.y), std::min(chunk.min.z, pos.z));
+				chunk.max = glm::vec3(std::max(chunk.max.x, pos.x), std::max(chunk.max.y, pos.y), std::max(chunk.max.z, pos.z));
+			}
+		}
+
+		// Граница клетки сетки чанков в координатах модели ([-1, 1] на всю карту)
+		static float chunkBorder(uint32_t k, uint32_t regions) {
+			return std::min(-1.0f + 2.0f * k * CHUNK_REGIONS / regions, 1.0f);
+		}
+
+		static Vertex lerp(const Vertex& a, const Vertex& b, float t) {
+			Vertex v = b;
+			v.pos = glm::vec4(a.pos.x + (b.pos.x - a.pos.x) * t, a.pos.y + (b.pos.y - a.pos.y) * t, a.pos.z + (b.pos.z - a.pos.z) * t, b.pos.w);
+			v.normal = a.normal + (b.normal - a.normal) * t;
+			return v;
+		}
+
+		// Отсечение выпуклого многоугольника полуплоскостью sign * (pos[axis] - border) >= 0 (Сазерленд - Ходжмен),
+		// точки пересечения кладутся ровно на границу, чтобы ребра на ней находились сравнением
+		static uint32_t clipPolygon(const Vertex* in, uint32_t count, Vertex* out, int axis, float border, float sign) {
+			uint32_t result = 0;
+			for (uint32_t i = 0; i < count; ++i) {
+				const Vertex& prev = in[(i + count - 1) % count];
+				const Vertex& cur = in[i];
+				float dPrev = sign * (prev.pos[axis] - border), dCur = sign * (cur.pos[axis] - border);
+				if ((dPrev < 0) != (dCur < 0)) {
+					out[result] = lerp(prev, cur, dPrev / (dPrev - dCur));
+					out[result++].pos[axis] = border;
+				}
+				if (dCur >= 0) {
+					out[result++] = cur;
+				}
+			}
+			return result;
+		}
+
+		// Треугольники одного чанка, обрезанные по его квадрату, и юбки вдоль внутренних сторон квадрата
+		void clipChunk(const std::vector< uint32_t >& triangles, uint32_t cx, uint32_t cy, std::vector< Vertex >& out) const {
+			float x0 = chunkBorder(cx, MAP_WIDTH), x1 = chunkBorder(cx + 1, MAP_WIDTH);
+			float y0 = chunkBorder(cy, MAP_HEIGHT), y1 = chunkBorder(cy + 1, MAP_HEIGHT);
+			std::array< Vertex, 8 > a, b;
+			for (uint32_t t : triangles) {
+				for (uint32_t i = 0; i < 3; ++i) {
+					a[i] = vertices[indices[3 * static_cast< size_t >(t) + i]];
+				}
+				uint32_t count = clipPolygon(a.data(), 3, b.data(), 0, x0, 1);
+				count = clipPolygon(b.data(), count, a.data(), 0, x1, -1);
+				count = clipPolygon(a.data(), count, b.data(), 1, y0, 1);
+				count = clipPolygon(b.data(), count, a.data(), 1, y1, -1);
+				for (uint32_t i = 2; i < count; ++i) {
+					out.push_back(a[0]);
+					out.push_back(a[i - 1]);
+					out.push_back(a[i]);
+				}
+			}
+			size_t surface = out.size();
+			auto onBorder = [&](const Vertex& p, const Vertex& q) {
+				return (p.pos.x == q.pos.x && ((p.pos.x == x0 && x0 > -1) || (p.pos.x == x1 && x1 < 1)))
+					|| (p.pos.y == q.pos.y && ((p.pos.y == y0 && y0 > -1) || (p.pos.y == y1 && y1 < 1)));
+			};
+			for (size_t i = 0; i < surface; i += 3) {
+				for (size_t j = 0; j < 3; ++j) {
+					Vertex p = out[i + j], q = out[i + (j + 1) % 3];
+					if (!onBorder(p, q)) continue;
+					Vertex pLow = p, qLow = q;
+					pLow.pos.z += SKIRT_DEPTH; // z+ уходит в землю
+					qLow.pos.z += SKIRT_DEPTH;
+					out.insert(out.end(), { p, q, qLow, p, qLow, pLow });
+				}
+			}
+		}
+
+		// Первая копия с тем же цветом становится общей вершиной, остальные удаляются, индексы перенумеровываются
+		void shareVertices(const std::vector< uint32_t >& copyOffset, const std::vector< uint32_t >& copies, ThreadPool& pool, size_t block) {
+			std::vector< uint32_t > target(vertices.size());
+			for (uint32_t slot = 0; slot < target.size(); ++slot) {
+				target[slot] = slot;
+			}
+			pool.parallelFor(0, copyOffset.size() - 1, 16 * block, [&](size_t from, size_t to) {
+				for (size_t v = from; v < to; ++v) {
+					for (uint32_t k = copyOffset[v] + 1; k < copyOffset[v + 1]; ++k) {
+						for (uint32_t j = copyOffset[v]; j < k; ++j) {
+							if (target[copies[j]] == copies[j] && vertices[copies[j]].color == vertices[copies[k]].color) {
+								target[copies[k]] = copies[j];
+								break;
+							}
+						}
+					}
+				}
+			});
+			uint32_t count = 0;
+			for (uint32_t slot = 0; slot < target.size(); ++slot) {
+				if (target[slot] == slot) {
+					vertices[count] = vertices[slot];
+					target[slot] = count++;
+				} else {
+					target[slot] = target[target[slot]]; // первая копия всегда раньше, её новый номер уже известен
+				}
+			}
+			vertices.resize(count);
+			vertices.shrink_to_fit();
+			pool.parallelFor(0, indices.size(), 16 * block, [&](size_t from, size_t to) {
+				for (size_t i = from; i < to; ++i) {
+					indices[i] = target[indices[i]];
+				}
+			});
+		}
+
+		static bool isTriangle(const FlatDiagram& diagram, uint32_t e) {
+			return diagram.edgeOrigin[e] != FlatDiagram::NONE && diagram.edgeEnd(e) != FlatDiagram::NONE;
+		}
+
+		void buildCell(const FlatDiagram& diagram, const std::vector< MapTile::Type >& tiles, PerlinNoise2D& perlin, size_t cell, uint32_t aIndex, size_t index) {
+			float aNoiseVal = perlin.noise((diagram.cellX[cell] / REGION_SIZE) / 64.0, (diagram.cellY[cell] / REGION_SIZE) / 64.0, 3);
+			glm::vec3 aColor = MapTile::getColor(tiles[diagram.cellValue[cell] - 1]);
+			Vertex a = { { 2 * diagram.cellX[cell] / (MAP_WIDTH * REGION_SIZE) - 1, 2 * diagram.cellY[cell] / (MAP_HEIGHT * REGION_SIZE) - 1, 1 - aNoiseVal, 0 }, aColor, {0, 0, 0}, { 0.0, 0.0, 0.0 } };
+			vertices[aIndex] = a;
+			uint32_t slot = aIndex + 1;
+			for (uint32_t e = diagram.cellEdges[cell]; e < diagram.cellEdges[cell + 1]; ++e) {
+				if (!isTriangle(diagram, e)) continue;
+				uint32_t start = diagram.edgeOrigin[e], end = diagram.edgeEnd(e);
+				double startX = diagram.vertexX[start], startY = diagram.vertexY[start], endX = diagram.vertexX[end], endY = diagram.vertexY[end];
+				float bNoiseVal = perlin.noise((std::max(0.0, startX) / REGION_SIZE) / 64.0, (std::max(0.0, startY) / REGION_SIZE) / 64.0, 3);
+				float cNoiseVal = perlin.noise((std::max(0.0, endX) / REGION_SIZE) / 64.0, (std::max(0.0, endY) / REGION_SIZE) / 64.0, 3);
+				Vertex b = { { 2 * startX / (MAP_WIDTH * REGION_SIZE) - 1, 2 * startY / (MAP_HEIGHT * REGION_SIZE) - 1, 1 - bNoiseVal, 0 }, aColor, {0, 0, 0}, { 0.0, 0.0, 0.0 } };
+				Vertex c = { { 2 * endX / (MAP_WIDTH * REGION_SIZE) - 1, 2 * endY / (MAP_HEIGHT * REGION_SIZE) - 1, 1 - cNoiseVal, 0 }, aColor, {0, 0, 0}, { 0.0, 0.0, 0.0 } };
+
+				glm::vec3 vec1 = { b.pos.x - a.pos.x, b.pos.y - a.pos.y, b.pos.z - a.pos.z };
+				glm::vec3 vec2 = { c.pos.x - a.pos.x, c.pos.y - a.pos.y, c.pos.z - a.pos.z };
+				glm::vec3 norm = glm::cross(vec1, vec2);
+
+				vertices[aIndex].normal += norm;
+				b.normal = c.normal = norm;
+				vertices[slot] = b;
+				vertices[slot + 1] = c;
+				slotVertex[slot] = start;
+				slotVertex[slot + 1] = end;
+				indices[index++] = aIndex;
+				indices[index++] = slot;
+				indices[index++] = slot + 1;
+				slot += 2;
+			}
+		}
+};
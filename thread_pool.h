@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом задач (work stealing) для fork/join рекурсии.
+// Вызывающий поток тоже участвует в работе, поэтому ThreadPool(1) выполняет всё последовательно.
+class ThreadPool {
+    public:
+        explicit ThreadPool(uint32_t threads = std::thread::hardware_concurrency()) {
+            threads = std::max(threads, 1u);
+            for (uint32_t i = 0; i < threads; ++i) {
+                queues.emplace_back(std::make_unique< Queue >());
+            }
+            for (uint32_t i = 1; i < threads; ++i) {
+                workers.emplace_back(&ThreadPool::workerLoop, this, i);
+            }
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard< std::mutex > lock(sleepMutex);
+                stopped = true;
+            }
+            sleepCv.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        uint32_t size() const {
+            return static_cast< uint32_t >(queues.size());
+        }
+
+        // Номер текущего потока в пуле [0, size()), внешние потоки делят номер 0
+        uint32_t workerIndex() const {
+            return currentPool == this ? currentWorker : 0;
+        }
+
+        // Выполняет left в текущем потоке, right отдаёт на перехват, возвращается после завершения обеих
+        template < typename L, typename R >
+        void invoke(L&& left, R&& right) {
+            Task task(std::forward< R >(right));
+            uint32_t index = workerIndex();
+            push(index, &task);
+            std::exception_ptr error = nullptr;
+            try {
+                left();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            if (popOwn(index, &task)) {
+                task.run();
+            } else {
+                while (!task.done.load(std::memory_order_acquire)) { // задачу украли, помогаем остальным
+                    if (!runOne(index)) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+            if (error != nullptr) {
+                std::rethrow_exception(error);
+            }
+            if (task.error != nullptr) {
+                std::rethrow_exception(task.error);
+            }
+        }
+
+        // Делит [begin, end) пополам до кусков не больше grain и вызывает func(from, to) для каждого куска
+        template < typename F >
+        void parallelFor(size_t begin, size_t end, size_t grain, const F& func) {
+            if (end - begin <= std::max< size_t >(grain, 1)) {
+                func(begin, end);
+                return;
+            }
+            size_t middle = begin + (end - begin) / 2;
+            invoke([&] { parallelFor(begin, middle, grain, func); }, [&] { parallelFor(middle, end, grain, func); });
+        }
+
+    private:
+        struct Task {
+            std::function< void() > func;
+            std::exception_ptr error = nullptr;
+            std::atomic< bool > done = false;
+
+            explicit Task(std::function< void() > func) : func(std::move(func)) {}
+
+            void run() {
+                try {
+                    func();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                done.store(true, std::memory_order_release);
+            }
+        };
+
+        struct Queue {
+            std::mutex mutex;
+            std::deque< Task* > tasks;
+        };
+
+        std::vector< std::unique_ptr< Queue > > queues;
+        std::vector< std::thread > workers;
+        std::atomic< uint32_t > pending = 0;
+        std::mutex sleepMutex;
+        std::condition_variable sleepCv;
+        bool stopped = false;
+
+        static thread_local ThreadPool* currentPool;
+        static thread_local uint32_t currentWorker;
+
+        void push(uint32_t index, Task* task) {
+            {
+                std::lock_guard< std::mutex > lock(queues[index]->mutex);
+                queues[index]->tasks.push_back(task);
+            }
+            pending.fetch_add(1, std::memory_order_release);
+            {
+                std::lock_guard< std::mutex > lock(sleepMutex);
+            }
+            sleepCv.notify_one();
+        }
+
+        bool popOwn(uint32_t index, Task* task) {
+            std::lock_guard< std::mutex > lock(queues[index]->mutex);
+            auto& tasks = queues[index]->tasks;
+            if (tasks.empty() || tasks.back() != task) {
+                return false;
+            }
+            tasks.pop_back();
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // Берёт задачу с конца своей очереди или крадёт из начала чужой
+        bool runOne(uint32_t index) {
+            Task* task = nullptr;
+            for (uint32_t k = 0; k < queues.size() && task == nullptr; ++k) {
+                Queue& queue = *queues[(index + k) % queues.size()];
+                std::lock_guard< std::mutex > lock(queue.mutex);
+                if (!queue.tasks.empty()) {
+                    if (k == 0) {
+                        task = queue.tasks.back();
+                        queue.tasks.pop_back();
+                    } else {
+                        task = queue.tasks.front();
+                        queue.tasks.pop_front();
+                    }
+                }
+            }
+            if (task == nullptr) {
+                return false;
+            }
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            task->run();
+            return true;
+        }
+
+        void workerLoop(uint32_t index) {
+            currentPool = this;
+            currentWorker = index;
+            while (true) {
+                if (runOne(index)) {
+                    continue;
+                }
+                std::unique_lock< std::mutex > lock(sleepMutex);
+                sleepCv.wait(lock, [this] { return stopped || pending.load(std::memory_order_acquire) > 0; });
+                if (stopped) {
+                    return;
+                }
+            }
+        }
+};
+
+inline thread_local ThreadPool* ThreadPool::currentPool = nullptr;
+inline thread_local uint32_t ThreadPool::currentWorker = 0;
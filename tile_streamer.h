@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "flat_diagram.h"
+#include "height_field.h"
+#include "map_tile.h"
+#include "perlin_noise_2d.h"
+#include "site_order.h"
+#include "terrain_mesh.h"
+#include "thread_pool.h"
+#include "voronoi_structs.h"
+
+// Плитка потоковой карты: TILE_REGIONS x TILE_REGIONS регионов. Вершины в координатах модели статической карты
+// (регион r по x занимает [-1 + 2r / MAP_WIDTH, -1 + 2(r + 1) / MAP_WIDTH]), индексы от начала плитки
+struct StreamedTile {
+    int32_t x = 0, y = 0;
+    std::vector< Vertex > vertices;
+    std::vector< uint32_t > indices;
+    glm::vec3 min, max;
+    HeightField heights;
+};
+
+// Бесконечная карта из плиток вокруг точки интереса. Отдельный поток заказывает недостающие плитки в радиусе,
+// ближние первыми, и строит их пакетами на пуле: смещения центров, диаграмма, сетка, карта высот.
+// Смещение центра региона зависит только от его координат и seed, поэтому плитка строится вместе с рамкой
+// из GHOST_REGIONS регионов соседей (value = 0, в сетку не попадают) и ячейки на стыке у соседних плиток совпадают.
+// Шум периодичен (256 единиц = PERIOD_REGIONS регионов), генерация идёт в координатах по модулю периода
+// в [PERIOD_REGIONS / 2, 3 * PERIOD_REGIONS / 2): они положительны, а шов периода, где вершины соседей совпадают лишь
+// до округления float, лежит в полупериоде от статической карты. Вершины потом переносятся на настоящее место плитки.
+class TileStreamer {
+    public:
+        static constexpr int32_t TILE_REGIONS = TerrainMesh::CHUNK_REGIONS;
+        static constexpr int32_t GHOST_REGIONS = 2;
+        static constexpr int64_t PERIOD_REGIONS = 256 * 64;
+        static constexpr double VERTEX_SNAP = 1024; // вершины диаграммы округляются до 1 / VERTEX_SNAP
+        // Места под плитку в буферах движка; в среднем у ячейки 6 треугольников, общих вершин чуть больше ячеек
+        static constexpr uint32_t MAX_VERTICES = 8 * TILE_REGIONS * TILE_REGIONS;
+        static constexpr uint32_t MAX_INDICES = 3 * 8 * TILE_REGIONS * TILE_REGIONS;
+
+        using DiagramBuilder = std::function< void(VoronoiDiagram&, ThreadPool&) >;
+
+        TileStreamer(PerlinNoise2D& perlin, uint32_t seed, ThreadPool& pool, int32_t radius, DiagramBuilder builder)
+            : perlin(perlin), seed(seed), pool(pool), radius(std::max(radius, 1)), builder(std::move(builder)) {}
+
+        TileStreamer(const TileStreamer&) = delete;
+        TileStreamer& operator=(const TileStreamer&) = delete;
+
+        ~TileStreamer() {
+            {
+                std::lock_guard< std::mutex > lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+
+        void start() {
+            worker = std::thread(&TileStreamer::generateLoop, this);
+        }
+
+        int32_t getRadius() const {
+            return radius;
+        }
+
+        // Сколько плиток одновременно в радиусе
+        size_t capacity() const {
+            return static_cast< size_t >(2 * radius + 1) * (2 * radius + 1);
+        }
+
+        // Точка интереса в координатах модели; при смене плитки поток генерации пересчитывает заказ
+        void setFocus(float x, float y) {
+            int32_t tx = tileOf(x, MAP_WIDTH), ty = tileOf(y, MAP_HEIGHT);
+            std::lock_guard< std::mutex > lock(mutex);
+            if (tx != focusX || ty != focusY) {
+                focusX = tx;
+                focusY = ty;
+                cv.notify_all();
+            }
+        }
+
+        bool inRange(int32_t x, int32_t y) const {
+            std::lock_guard< std::mutex > lock(mutex);
+            return std::max(std::abs(x - focusX), std::abs(y - focusY)) <= radius;
+        }
+
+        // Построенные с прошлого вызова плитки; ошибка потока генерации пробрасывается сюда
+        std::vector< std::shared_ptr< const StreamedTile > > takeReady() {
+            std::lock_guard< std::mutex > lock(mutex);
+            if (error != nullptr) {
+                std::rethrow_exception(error);
+            }
+            std::vector< std::shared_ptr< const StreamedTile > > result;
+            result.swap(ready);
+            return result;
+        }
+
+        // Плитка больше не нужна движку; если снова войдёт в радиус, будет построена заново
+        void release(int32_t x, int32_t y) {
+            std::lock_guard< std::mutex > lock(mutex);
+            resident.erase({ x, y });
+            cv.notify_all();
+        }
+
+        // Шум [0, 1] в точке модели: по карте высот построенной плитки, иначе напрямую
+        float height(float x, float y) {
+            float rx = (x + 1) * MAP_WIDTH / 2, ry = (y + 1) * MAP_HEIGHT / 2;
+            int32_t tx = static_cast< int32_t >(std::floor(rx / TILE_REGIONS)), ty = static_cast< int32_t >(std::floor(ry / TILE_REGIONS));
+            float nx = (origin(tx) + rx - static_cast< float >(tx) * TILE_REGIONS) / 64, ny = (origin(ty) + ry - static_cast< float >(ty) * TILE_REGIONS) / 64;
+            {
+                std::lock_guard< std::mutex > lock(mutex);
+                auto it = resident.find({ tx, ty });
+                if (it != resident.end() && it->second != nullptr) {
+                    return it->second->heights.sample(nx, ny);
+                }
+            }
+            return perlin.noise(nx, ny, 3);
+        }
+
+    private:
+        PerlinNoise2D& perlin;
+        const uint32_t seed;
+        ThreadPool& pool;
+        const int32_t radius;
+        DiagramBuilder builder;
+
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::thread worker;
+        bool stopping = false;
+        std::exception_ptr error = nullptr;
+        int32_t focusX = 0, focusY = 0;
+        // Заказанные и построенные плитки; nullptr - ещё строится
+        std::map< std::pair< int32_t, int32_t >, std::shared_ptr< const StreamedTile > > resident;
+        std::vector< std::shared_ptr< const StreamedTile > > ready;
+
+        static int32_t tileOf(float v, uint32_t regions) {
+            return static_cast< int32_t >(std::floor((v + 1) * regions / 2 / TILE_REGIONS));
+        }
+
+        // Регион начала плитки в координатах генерации
+        static int64_t origin(int32_t tile) {
+            int64_t region = static_cast< int64_t >(tile) * TILE_REGIONS + PERIOD_REGIONS / 2;
+            return PERIOD_REGIONS / 2 + ((region % PERIOD_REGIONS) + PERIOD_REGIONS) % PERIOD_REGIONS;
+        }
+
+        uint32_t regionSeed(int64_t x, int64_t y) const {
+            x %= PERIOD_REGIONS;
+            y %= PERIOD_REGIONS;
+            return static_cast< uint32_t >((x * 73856093) ^ (y * 19349663)) ^ seed;
+        }
+
+        // Недостающие плитки радиуса, ближние к точке интереса первыми; вызывается под mutex
+        std::vector< std::pair< int32_t, int32_t > > missingTiles() const {
+            std::vector< std::pair< int32_t, int32_t > > missing;
+            for (int32_t y = focusY - radius; y <= focusY + radius; ++y) {
+                for (int32_t x = focusX - radius; x <= focusX + radius; ++x) {
+                    if (resident.count({ x, y }) == 0) missing.emplace_back(x, y);
+                }
+            }
+            std::sort(missing.begin(), missing.end(), [&](const auto& a, const auto& b) {
+                auto distance = [&](const std::pair< int32_t, int32_t >& t) {
+                    return (t.first - focusX) * (t.first - focusX) + (t.second - focusY) * (t.second - focusY);
+                };
+                return distance(a) < distance(b);
+            });
+            return missing;
+        }
+
+        void generateLoop() {
+            while (true) {
+                std::vector< std::pair< int32_t, int32_t > > batch;
+                {
+                    std::unique_lock< std::mutex > lock(mutex);
+                    cv.wait(lock, [&] { return stopping || !(batch = missingTiles()).empty(); });
+                    if (stopping) return;
+                    batch.resize(std::min< size_t >(batch.size(), pool.size()));
+                    for (const auto& tile : batch) {
+                        resident[tile] = nullptr;
+                    }
+                }
+                std::vector< std::shared_ptr< const StreamedTile > > built(batch.size());
+                try {
+                    pool.parallelFor(0, batch.size(), 1, [&](size_t from, size_t to) {
+                        for (size_t i = from; i < to; ++i) {
+                            built[i] = generate(batch[i].first, batch[i].second);
+                        }
+                    });
+                } catch (...) {
+                    std::lock_guard< std::mutex > lock(mutex);
+                    error = std::current_exception();
+                    return;
+                }
+                std::lock_guard< std::mutex > lock(mutex);
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    auto it = resident.find(batch[i]);
+                    if (it == resident.end()) continue; // отпущена, пока строилась
+                    it->second = built[i];
+                    ready.push_back(built[i]);
+                }
+            }
+        }
+
+        std::shared_ptr< const StreamedTile > generate(int32_t tx, int32_t ty) {
+            const int32_t SIDE = TILE_REGIONS + 2 * GHOST_REGIONS, TYPES = SIDE + 2;
+            int64_t gx = origin(tx) - GHOST_REGIONS, gy = origin(ty) - GHOST_REGIONS;
+
+            // Типы регионов рамки и ещё одного ряда вокруг: по соседям выбирается направление смещения, как в main
+            std::vector< MapTile::Type > types(TYPES * TYPES);
+            for (int32_t i = 0; i < TYPES; ++i) {
+                for (int32_t j = 0; j < TYPES; ++j) {
+                    types[i * TYPES + j] = MapTile::getTile(perlin.noise((gx + j - 1) / 64.0f, (gy + i - 1) / 64.0f, 3));
+                }
+            }
+            VoronoiDiagram diagram(pool.size());
+            std::vector< MapTile::Type > tiles(TILE_REGIONS * TILE_REGIONS);
+            std::uniform_real_distribution< double > regionRand(-0.4 * REGION_SIZE, 0.4 * REGION_SIZE);
+            const int32_t dx[] = { -1, -1, 1, 1 }, dy[] = { -1, 1, 1, -1 };
+            for (int32_t i = 0; i < SIDE; ++i) {
+                for (int32_t j = 0; j < SIDE; ++j) {
+                    auto type = [&](int32_t di, int32_t dj) {
+                        return types[(i + 1 + di) * TYPES + j + 1 + dj];
+                    };
+                    int32_t moveX = 0, moveY = 0;
+                    for (int32_t k = 0; k < 4; ++k) {
+                        if (type(dy[k], dx[k]) == type(0, 0) && (type(0, dx[k]) != type(0, 0) || type(dy[k], 0) != type(0, 0))) {
+                            moveX += dx[k];
+                            moveY += dy[k];
+                        } else if (type(dy[k], dx[k]) != type(0, 0) && type(0, dx[k]) != type(0, 0) && type(dy[k], 0) != type(0, 0)) {
+                            moveX -= dx[k];
+                            moveY -= dy[k];
+                        }
+                    }
+                    std::default_random_engine engine(regionSeed(gx + j, gy + i));
+                    double x = REGION_SIZE / 2 + (gx + j) * REGION_SIZE + std::round(moveX == 0 ? regionRand(engine) : (moveX < 0 ? -std::abs(regionRand(engine)) : std::abs(regionRand(engine))));
+                    double y = REGION_SIZE / 2 + (gy + i) * REGION_SIZE + std::round(moveY == 0 ? regionRand(engine) : (moveY < 0 ? -std::abs(regionRand(engine)) : std::abs(regionRand(engine))));
+                    int32_t li = i - GHOST_REGIONS, lj = j - GHOST_REGIONS;
+                    if (li >= 0 && li < TILE_REGIONS && lj >= 0 && lj < TILE_REGIONS) {
+                        tiles[li * TILE_REGIONS + lj] = type(0, 0);
+                        diagram.addCell(x, y, li * TILE_REGIONS + lj + 1, li * TILE_REGIONS + lj + 1);
+                    } else {
+                        diagram.addCell(x, y);
+                    }
+                }
+            }
+            std::vector< Cell* >& cells = diagram.cells;
+            orderSites(cells, pool);
+            builder(diagram, pool);
+            // Вершины на стыке соседи считают разным порядком слияний, расхождение порядка 1e-10 убирает округление
+            FlatDiagram flat(cells);
+            for (std::vector< double >* coords : { &flat.vertexX, &flat.vertexY }) {
+                for (double& v : *coords) {
+                    v = std::round(v * VERTEX_SNAP) / VERTEX_SNAP;
+                }
+            }
+            TerrainMesh mesh;
+            mesh.build(flat, tiles, perlin, pool, true);
+            if (mesh.vertices.size() > MAX_VERTICES || mesh.indices.size() > MAX_INDICES) {
+                throw std::runtime_error("Streamed tile is too large: " + std::to_string(mesh.vertices.size()) + " vertices, " + std::to_string(mesh.indices.size()) + " indices");
+            }
+
+            auto tile = std::make_shared< StreamedTile >();
+            tile->x = tx;
+            tile->y = ty;
+            tile->vertices = std::move(mesh.vertices);
+            tile->indices = std::move(mesh.indices);
+            double shiftX = 2.0 * (static_cast< double >(tx) * TILE_REGIONS - origin(tx)) / MAP_WIDTH;
+            double shiftY = 2.0 * (static_cast< double >(ty) * TILE_REGIONS - origin(ty)) / MAP_HEIGHT;
+            for (Vertex& vertex : tile->vertices) {
+                vertex.pos.x = static_cast< float >(vertex.pos.x + shiftX);
+                vertex.pos.y = static_cast< float >(vertex.pos.y + shiftY);
+            }
+            const glm::vec4& first = tile->vertices.front().pos;
+            tile->min = tile->max = glm::vec3(first.x, first.y, first.z);
+            for (const Vertex& vertex : tile->vertices) {
+                tile->min = glm::vec3(std::min(tile->min.x, vertex.pos.x), std::min(tile->min.y, vertex.pos.y), std::min(tile->min.z, vertex.pos.z));
+                tile->max = glm::vec3(std::max(tile->max.x, vertex.pos.x), std::max(tile->max.y, vertex.pos.y), std::max(tile->max.z, vertex.pos.z));
+            }
+            tile->heights.build(perlin, TILE_REGIONS / 64.0f, TILE_REGIONS / 64.0f, 128, 3, nullptr, origin(tx) / 64.0f, origin(ty) / 64.0f);
+            return tile;
+        }
+};
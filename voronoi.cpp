@@ -8,9 +8,23 @@
 #include <sstream>
 #include <memory>
 #include <limits>
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+	#include <sys/resource.h>
+#endif
 
 #include "voronoi_structs.h"
+#include "convex_hull.h"
+#include "flat_diagram.h"
+#include "geometry_kernel.h"
+#include "map_cache.h"
 #include "perlin_noise_2d.h"
+#include "site_order.h"
+#include "terrain_mesh.h"
+#include "thread_pool.h"
+#include "tile_streamer.h"
 #include "vulkan_engine.h"
 
 
@@ -30,20 +44,82 @@ void printCell(Cell* cell) {
 	
 }
 
+// Пиковый объём резидентной памяти процесса в КБ (0, если недоступно)
+long peakMemoryKb() {
+#ifndef _WIN32
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		return usage.ru_maxrss;
+	}
+#endif
+	return 0;
+}
+
+// Хеш топологии и вершин диаграммы, для сравнения последовательной и параллельной сборки.
+// Без vertices - только топология (соседи каждой ячейки по порядку): ядра сборки округляют вершины по-разному
+uint64_t diagramHash(const std::vector< Cell* >& cells, bool vertices = true) {
+	uint64_t hash = 1469598103934665603ull;
+	auto mix = [&hash](double v) {
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		hash = (hash ^ bits) * 1099511628211ull;
+	};
+	for (auto cell : cells) {
+		mix(cell->x);
+		mix(cell->y);
+		auto curr = cell->head;
+		if (curr == nullptr) continue;
+		do {
+			if (!vertices) {
+				mix(curr->twin->cell->x);
+				mix(curr->twin->cell->y);
+				curr = curr->next;
+				continue;
+			}
+			auto start = curr->getStart(), end = curr->getEnd();
+			mix(start != nullptr ? start->x : std::numeric_limits< double >::infinity());
+			mix(start != nullptr ? start->y : std::numeric_limits< double >::infinity());
+			mix(end != nullptr ? end->x : std::numeric_limits< double >::infinity());
+			mix(end != nullptr ? end->y : std::numeric_limits< double >::infinity());
+			curr = curr->next;
+		} while (curr != cell->head);
+	}
+	return hash;
+}
+
 class VoronoiChainTree {
 	public:
 		std::unique_ptr< VoronoiChainTree > l = nullptr, r = nullptr;
 		std::vector< Cell* > left, right;
-		std::vector< std::shared_ptr< Point > > chain;
+		std::vector< Point* > chain;
 
 
 };
 
+// Порядок центров окружностей через l, r, p и через l, r, q на серединном перпендикуляре lr при обходе шва сверху вниз:
+// -1 - первый раньше, 1 - позже, 0 - совпадают. Центр для p идёт раньше, если q внутри его окружности и лежит с другой
+// стороны от lr, чем направление обхода, - это знаки incircle и orientation по самим сайтам, без округлённых пересечений.
+// nullopt, если p или q на прямой lr (центр на бесконечности). oq - уже известный orientation(l, r, q) ядра Kernel
+template < typename Kernel >
+std::optional< int > seamOrder(const Point* l, const Point* r, const Point* p, const Point* q, int oq) {
+	int op = Kernel::orientation(l, r, p);
+	if (op == 0 || oq == 0) return std::nullopt;
+	int down = l->x < r->x || (l->x == r->x && l->y < r->y) ? 1 : -1; // (r - l) повёрнутый по часовой смотрит вниз
+	return -down * op * oq * Kernel::incircle(l, r, p, q);
+}
+
+template < typename Kernel >
+std::optional< int > seamOrder(const Point* l, const Point* r, const Point* p, const Point* q) {
+	return seamOrder< Kernel >(l, r, p, q, Kernel::orientation(l, r, q));
+}
+
+template < typename Kernel >
 class HalfEdgePtr {
 	
 	public:
 		Cell* cell;
-		std::shared_ptr< Point > cp = nullptr;
+		std::optional< Point > cp; // пересечение со швом, в диаграмму попадает только выбранное
+		Point* cpVertex = nullptr; // существующая вершина ребра, если пересечение совпало с ней
 		HalfEdge* top = nullptr;
 		HalfEdge* edge;
 		bool headSkipped = false;
@@ -53,39 +129,54 @@ class HalfEdgePtr {
 		void set(HalfEdge* newEdge) {
 			cell = newEdge->cell;
 			top = edge = newEdge;
-			cp = nullptr;
+			cp.reset();
+			cpVertex = nullptr;
 			headSkipped = false;
 		}
 
-		void intersection(const Line& seam, std::shared_ptr< Point > last) {
+		// Первое пересечение шва (между cell и other) с рёбрами cell после вершины last; lastSite - третий сайт, задавший last.
+		// «После last» решает seamOrder по сайтам: пересечение, пересчитанное по другим прямым, может отойти от last
+		// дальше допуска fuzzyCompare, и обход возвращался в пройденную ячейку
+		void intersection(const Line& seam, const Point* last, const Cell* other, const Point* lastSite) {
 			if (edge != nullptr) {
 				auto start = edge;
+				int lastSide = last != nullptr ? Kernel::orientation(cell, other, lastSite) : 0;
 				do {
-					auto p = edge->getLine().intersection(seam);
-					if (p != nullptr) {
-						int cmpY = last == nullptr ? -1 : fuzzyCompare(p->y, last->y);
-						if ((cmpY < 0 || (cmpY == 0 && fuzzyCompare(p->x, last->x) > 0)) && edge->onEdge(*p)) {
-							int eq = p->fuzzyEquals(edge->getStart().get()) ? -1 : (p->fuzzyEquals(edge->getEnd().get()) ? 1 : 0);
-                            if (eq == 0) {
-                                cp = p;
-                            } else if (eq == -1) {
-                                cp = edge->getStart();
-                                if (clockwise) move();
-                            } else {
-                                cp = edge->getEnd();
-                                if (!clockwise) move();
-                            }
-                            return;
-						}
+					auto p = Kernel::seamVertex(edge, seam, other);
+					if (p.has_value() && edge->onEdge(*p) && isAfter(*p, last, other, lastSite, lastSide)) {
+						int eq = p->fuzzyEquals(edge->getStart()) ? -1 : (p->fuzzyEquals(edge->getEnd()) ? 1 : 0);
+                        cpVertex = eq == 0 ? nullptr : (eq == -1 ? edge->getStart() : edge->getEnd());
+                        cp = cpVertex != nullptr ? *cpVertex : *p;
+                        if (eq == -1 && clockwise) {
+                            move();
+                        } else if (eq == 1 && !clockwise) {
+                            move();
+                        }
+                        return;
 					}
 					move();
 				} while (edge != start);
 			}
-			cp = nullptr;
+			cp.reset();
+			cpVertex = nullptr;
 		}
+
+		Point* accept(DiagramStorage& storage) {
+			return cpVertex != nullptr ? cpVertex : storage.createPoint(cp->x, cp->y);
+		}
+
 	private:
 		const bool clockwise;
 
+		bool isAfter(const Point& p, const Point* last, const Cell* other, const Point* lastSite, int lastSide) const {
+			if (last == nullptr) return true;
+			if (edge->twin->cell == lastSite || p.fuzzyEquals(last)) return false; // та же вершина, как и при выборе между левым и правым
+			auto order = seamOrder< Kernel >(cell, other, edge->twin->cell, lastSite, lastSide);
+			if (order.has_value()) return *order > 0;
+			int cmpY = fuzzyCompare(p.y, last->y);
+			return cmpY < 0 || (cmpY == 0 && fuzzyCompare(p.x, last->x) > 0);
+		}
+
 		void move() {
             if (clockwise) {
                 headSkipped = headSkipped || edge == cell->head;
@@ -97,113 +188,14 @@ class HalfEdgePtr {
         }
 };
 
-class PolyNode {
-    public:
-        Point* p;
-        PolyNode* next = nullptr;
-        PolyNode* prev = nullptr;
-
-        static PolyNode* makeNode(Point* p) {
-            auto node = new PolyNode(p);
-            return node->next = node->prev = node;
-        }
-
-    private:
-        PolyNode(Point* p) : p(p) {}
-};
-
-std::pair< PolyNode*, PolyNode* > findRightChain(Point* p, PolyNode* right) {
-	if (right == right->next) return std::make_pair(right, right);
-	if (right->next == right->prev) {
-		return Point::orientation(p, right->p, right->next->p) < 0
-			? std::make_pair(right->next, right)
-			: std::make_pair(right, right->next);
-	}
-	PolyNode* current = right;
-	std::pair< PolyNode*, PolyNode* > chain{ nullptr, nullptr };
-	while (chain.first == nullptr || chain.second == nullptr) {
-		int prev_orient = Point::orientation(p, current->p, current->prev->p);
-		int next_orient = Point::orientation(p, current->p, current->next->p);
-
-		if (chain.first == nullptr && prev_orient > 0 && next_orient >= 0)
-			chain.first = current;
-
-		if (chain.second == nullptr && prev_orient <= 0 && next_orient < 0)
-			chain.second = current;
-
-        current = current->next;
-	}
-	return chain;
-}
-
-std::pair< PolyNode*, std::pair< Point*, Point* > > merge(PolyNode* left, PolyNode* right) {
-	auto chain = findRightChain(left->p, right);
-	PolyNode* l = left->next == left ? nullptr : left->next;
-	PolyNode* r = chain.first;
-	std::vector< PolyNode* > m;
-	size_t low = 0, up = 0;
-	m.emplace_back(left);
-	while (l != nullptr || r != nullptr) {
-		PolyNode* curr;
-		bool rside = l == nullptr || (r != nullptr && Point::orientation(left->p, l->p, r->p) < 0);
-		if (rside) {
-			curr = r;
-			r = r == chain.second ? nullptr : r->next;
-		} else {
-			curr = l;
-			l = l->next == left ? nullptr : l->next;
-		}
-		while (m.size() >= 2 && Point::orientation(m[m.size() - 2]->p, m[m.size() - 1]->p, curr->p) <= 0) {
-			m.pop_back();
-		}
-		if (m[m.size() - 1]->next != curr) {
-			if (rside) {
-				low = m.size() - 1;
-			} else {
-				up = m.size() - 1;
-			}
-		}
-        m.emplace_back(curr);
-	}
-	if (m.size() > 2 && Point::orientation(m[m.size() - 2]->p, m[m.size() - 1]->p, m[0]->p) <= 0) { // может быть только == 0
-		m.pop_back();
-	}
-	if (m[m.size() - 1]->next != m[0]) {
-		up = m.size() - 1;
-	}
-	size_t up2 = (up + 1) % m.size();
-	std::pair< Point*, Point* > bridge = std::make_pair(m[up]->p, m[up2]->p);
-	if (Point::orientation(m[up]->p, m[up]->next->p, m[up2]->p) == 0) {
-		bridge.first = m[up]->next->p;
-	}
-	if (Point::orientation(m[up]->p, m[up2]->prev->p, m[up2]->p) == 0) {
-		bridge.second = m[up2]->prev->p;
-	}
-	m[low]->next = m[low + 1];
-	m[low + 1]->prev = m[low];
-	m[up]->next = m[up2];
-	m[up2]->prev = m[up];
-	return std::make_pair(m[0], bridge); // left
-}
-
-PolyNode* kirkpatrick(const std::vector< Point* >& points, size_t begin, size_t end) {
-	if (end - begin == 1) {
-		return PolyNode::makeNode(points[begin]);
-	}
-	size_t mid = (begin + end) / 2;
-	auto left = kirkpatrick(points, begin, mid);
-	auto right = kirkpatrick(points, mid, end);
-	return merge(left, right).first;
-}
-
-void markEdgesForDeletion(HalfEdge* curr, HalfEdge* finish, std::vector< HalfEdge* >& deletion) {
+void markEdgesForDeletion(HalfEdge* curr, HalfEdge* finish, DiagramStorage& storage) {
 	while (curr != finish) {
-		deletion.emplace_back(curr);
+		storage.retire(curr);
 		curr = curr->next;
 	}
 }
 
-void connectChain(HalfEdge* first, HalfEdge* chainStart, HalfEdge* second, bool headSkipped, std::vector< HalfEdge* >& deletion) {
+void connectChain(HalfEdge* first, HalfEdge* chainStart, HalfEdge* second, bool headSkipped, DiagramStorage& storage) {
 	Cell* cell = chainStart->cell;
 	auto chainEnd = chainStart->prev;
 	if (first != nullptr && second != nullptr) { // Два пересечения
@@ -213,7 +205,7 @@ void connectChain(HalfEdge* first, HalfEdge* chainStart, HalfEdge* second, bool
 			}
 			headSkipped = false;
 		} else { // Отрезаем кусок ячейки
-			markEdgesForDeletion(first->next, second, deletion);
+			markEdgesForDeletion(first->next, second, storage);
 		}
 		first->next = chainStart; //edges for delete
 		chainStart->prev = first;
@@ -229,14 +221,14 @@ void connectChain(HalfEdge* first, HalfEdge* chainStart, HalfEdge* second, bool
 		}
 		cell->head = chainStart;
 	} else if (first == nullptr) { 
-		markEdgesForDeletion(cell->head->prev->next, second, deletion);
+		markEdgesForDeletion(cell->head->prev->next, second, storage);
 		cell->head->prev->next = chainStart;
 		chainStart->prev = cell->head->prev;
 		second->prev = chainEnd;
 		chainEnd->next = second;
 		cell->head = chainStart;
 	} else {
-		markEdgesForDeletion(first->next, cell->head, deletion);
+		markEdgesForDeletion(first->next, cell->head, storage);
 		first->next = chainStart;
 		chainStart->prev = first;
 		cell->head->prev = chainEnd;
@@ -254,193 +246,367 @@ HalfEdge* addChainLink(HalfEdge* edge, HalfEdge* head, bool inHead) {
 	return inHead ? edge : head;
 }
 
-void mergeVoronoi(const std::pair< Point*, Point* >& bridge) {
-	HalfEdgePtr left = HalfEdgePtr(static_cast< Cell* >(bridge.second), true);
-	HalfEdgePtr right = HalfEdgePtr(static_cast< Cell* >(bridge.first), false);
-	std::vector< HalfEdge* > deletion;
-	std::shared_ptr< Point > lastP = nullptr;
+template < typename Kernel >
+void mergeVoronoi(const std::pair< Point*, Point* >& bridge, DiagramStorage& storage) {
+	HalfEdgePtr< Kernel > left(static_cast< Cell* >(bridge.second), true);
+	HalfEdgePtr< Kernel > right(static_cast< Cell* >(bridge.first), false);
+	Point* lastP = nullptr;
+	const Point* lastSite = nullptr;
 	HalfEdge* leftChain = nullptr;
 	HalfEdge* rightChain = nullptr;
 	while (true) {
 		Point mid = Point((left.cell->x + right.cell->x) / 2, (left.cell->y + right.cell->y) / 2);
 		Line seam = Line::perpendicular(*left.cell, *right.cell, mid);
-		left.intersection(seam, lastP);
-		right.intersection(seam, lastP);
-		if (left.cp == nullptr && right.cp == nullptr) {
-			auto edge = HalfEdge::createEdge(nullptr, lastP, seam, left.cell, right.cell);
+		left.intersection(seam, lastP, right.cell, lastSite);
+		right.intersection(seam, lastP, left.cell, lastSite);
+		if (!left.cp.has_value() && !right.cp.has_value()) {
+			auto edge = HalfEdge::createEdge(nullptr, lastP, seam, left.cell, right.cell, storage);
         	leftChain = addChainLink(edge, leftChain, true);
             rightChain = addChainLink(edge->twin, rightChain, false);
-            connectChain(nullptr, leftChain, left.top, left.headSkipped, deletion);
-            connectChain(right.top, rightChain, nullptr, right.headSkipped, deletion);
+            connectChain(nullptr, leftChain, left.top, left.headSkipped, storage);
+            connectChain(right.top, rightChain, nullptr, right.headSkipped, storage);
 			break;
 		}
-		int cmp = left.cp == nullptr ? 1 : (right.cp == nullptr ? -1 : fuzzyCompare(right.cp->y, left.cp->y));
-		std::shared_ptr< Point > point = cmp <= 0 ? left.cp : right.cp;
-		auto edge = HalfEdge::createEdge(point, lastP, seam, left.cell, right.cell);
+		int cmp = !left.cp.has_value() ? 1 : (!right.cp.has_value() ? -1 : 0);
+		if (left.cp.has_value() && right.cp.has_value() && !left.cp->fuzzyEquals(&*right.cp)) { // совпавшие в пределах допуска - одна вершина
+			auto order = seamOrder< Kernel >(left.cell, right.cell, left.edge->twin->cell, right.edge->twin->cell);
+			cmp = order.has_value() ? *order : fuzzyCompare(right.cp->y, left.cp->y);
+		}
+		Point* point = cmp <= 0 ? left.accept(storage) : right.accept(storage);
+		auto edge = HalfEdge::createEdge(point, lastP, seam, left.cell, right.cell, storage);
 		leftChain = addChainLink(edge, leftChain, true);
 		rightChain = addChainLink(edge->twin, rightChain, false);
 		lastP = point;
+		lastSite = cmp <= 0 ? left.cell : right.cell;
 		if (cmp <= 0) {
-			auto intersectTwin = point->fuzzyEquals(left.edge->getEnd().get()) ? left.edge->next->twin->next : left.edge->twin;
-			left.edge->setEnd(point);
-			intersectTwin->setStart(point);
-			connectChain(left.edge, leftChain, left.top, left.headSkipped, deletion);
+			auto intersectTwin = point->fuzzyEquals(left.edge->getEnd()) ? left.edge->next->twin->next : left.edge->twin;
+			left.edge->setEnd(point, storage);
+			intersectTwin->setStart(point, storage);
+			connectChain(left.edge, leftChain, left.top, left.headSkipped, storage);
 			left.set(intersectTwin);
 			leftChain = nullptr;
 		}
 		if (cmp >= 0) {
 			auto intersectTwin = right.edge->twin;
-			if (point->fuzzyEquals(right.edge->getStart().get())) {
+			if (point->fuzzyEquals(right.edge->getStart())) {
 				while (right.edge->prev->twin->prev != intersectTwin) {
-					intersectTwin->setEnd(point);
+					intersectTwin->setEnd(point, storage);
 					intersectTwin = intersectTwin->next->twin;
 				}
 			}
-			right.edge->setStart(point);
-			intersectTwin->setEnd(point);
-			connectChain(right.top, rightChain, right.edge, right.headSkipped, deletion);
+			right.edge->setStart(point, storage);
+			intersectTwin->setEnd(point, storage);
+			connectChain(right.top, rightChain, right.edge, right.headSkipped, storage);
 			right.set(intersectTwin);
 			rightChain = nullptr;
 		}
 	}
-	for (size_t i = 0; i < deletion.size(); ++i) {
-		delete deletion[i];
-	}
+	storage.recycle();
 }
 
-PolyNode* voronoi(const std::vector< Cell* >& cells, size_t begin, size_t end) {
+// Coord - тип координат ядра GeometryKernel, одного на всю сборку
+template < typename Coord >
+uint32_t voronoi(const std::vector< Cell* >& cells, size_t begin, size_t end, DiagramStorage& storage, HullNodes& hull) {
+	using Kernel = GeometryKernel< Coord >;
 	if (end - begin == 1) {
-		return PolyNode::makeNode(cells[begin]);
+		return hull.makeNode(static_cast< uint32_t >(begin));
 	}
 	size_t mid = (begin + end) / 2;
-	auto left = voronoi(cells, begin, mid);
-	auto right = voronoi(cells, mid, end);
-	auto merged = merge(left, right);
-	mergeVoronoi(merged.second);
+	auto left = voronoi< Coord >(cells, begin, mid, storage, hull);
+	auto right = voronoi< Coord >(cells, mid, end, storage, hull);
+	auto merged = mergeHulls< Cell, Kernel::orientation >(cells, hull, left, right, storage.hullStack());
+	mergeVoronoi< Kernel >(merged.second, storage);
 	return merged.first;
 }
 
-int main(int argc, char** argv) {
-	// freopen("output.txt", "w", stdout);
-	int32_t seed = time(0); //1685906448 1686078735 1686224088
-	std::cout << "Seed: " << seed << std::endl;
-	PerlinNoise2D perlin(seed);
-	perlin.saveImage(MAP_WIDTH, MAP_HEIGHT, 64, 3);
+// Параллельная сборка: половины длиннее cutoff отдаются в пул, слияние выполняется после join.
+// Каждое слияние зависит только от своих половин, поэтому диаграмма совпадает с последовательной.
+// diagram должна иметь не меньше pool.size() слотов памяти. Возвращает узел самой левой точки оболочки в diagram.hull
+template < typename Coord >
+uint32_t voronoi(const std::vector< Cell* >& cells, size_t begin, size_t end, VoronoiDiagram& diagram, ThreadPool& pool, size_t cutoff) {
+	using Kernel = GeometryKernel< Coord >;
+	diagram.hull.reserve(cells.size()); // до раздачи половин в пул, вложенные вызовы размер уже не меняют
+	if (end - begin <= std::max< size_t >(cutoff, 1)) {
+		return voronoi< Coord >(cells, begin, end, diagram.storage(pool.workerIndex()), diagram.hull);
+	}
+	size_t mid = (begin + end) / 2;
+	uint32_t left = 0;
+	uint32_t right = 0;
+	pool.invoke([&] { left = voronoi< Coord >(cells, begin, mid, diagram, pool, cutoff); }, [&] { right = voronoi< Coord >(cells, mid, end, diagram, pool, cutoff); });
+	DiagramStorage& storage = diagram.storage(pool.workerIndex());
+	auto merged = mergeHulls< Cell, Kernel::orientation >(cells, diagram.hull, left, right, storage.hullStack());
+	mergeVoronoi< Kernel >(merged.second, storage);
+	return merged.first;
+}
 
-	std::vector<Cell*> cells;
-	std::vector<MapTile::Type> tiles;
-	for (int32_t i = 0; i < MAP_HEIGHT; ++i) {
-		for (int32_t j = 0; j < MAP_WIDTH; ++j) {
-			cells.push_back(new Cell(REGION_SIZE / 2 + j * REGION_SIZE, REGION_SIZE / 2 + i * REGION_SIZE, i * MAP_WIDTH + j + 1, i * MAP_WIDTH + j + 1));
-			tiles.push_back(MapTile::getTile(perlin.noise(j / 64.0f, i / 64.0f, 3)));
+// Целые сайты с размахом до GeometryKernel< int64_t >::SPAN (карта, LOD, плитки потока) строятся точным целочисленным ядром, остальные - ядром double
+uint32_t voronoi(const std::vector< Cell* >& cells, size_t begin, size_t end, VoronoiDiagram& diagram, ThreadPool& pool, size_t cutoff) {
+	if (GeometryKernel< int64_t >::accepts(cells, begin, end)) {
+		return voronoi< int64_t >(cells, begin, end, diagram, pool, cutoff);
+	}
+	return voronoi< double >(cells, begin, end, diagram, pool, cutoff);
+}
+
+// Время сборки диаграммы в зависимости от числа потоков, на копиях отсортированных ячеек.
+// Затем повторные сборки на одном пуле: пропускная способность и пиковая память, которая не должна расти от сборки к сборке
+void benchVoronoi(const std::vector< Cell* >& cells, size_t cutoff, uint32_t maxThreads, uint32_t rebuilds = 10) {
+	using Builder = uint32_t (*)(const std::vector< Cell* >&, size_t, size_t, VoronoiDiagram&, ThreadPool&, size_t);
+	auto build = [&](ThreadPool& pool, VoronoiDiagram& copy, Builder builder = voronoi) {
+		copy.cells.reserve(cells.size());
+		for (auto cell : cells) {
+			copy.addCell(cell->x, cell->y, cell->value, cell->index);
 		}
+		auto start = std::chrono::steady_clock::now();
+		builder(copy.cells, 0, copy.cells.size(), copy, pool, cutoff);
+		return std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count();
+	};
+	{
+		// Упорядочивание сайтов: прежняя сортировка с fuzzyCompare против orderSites на перемешанных копиях
+		std::vector< Cell* > shuffled(cells.begin(), cells.end());
+		std::shuffle(shuffled.begin(), shuffled.end(), std::default_random_engine(1));
+		std::vector< Cell* > fuzzySorted = shuffled, radixSorted = shuffled;
+		auto fuzzyStart = std::chrono::steady_clock::now();
+		std::sort(fuzzySorted.begin(), fuzzySorted.end(), [](Cell* a, Cell* b) { return fuzzyCompare(a->x, b->x) == -1 || (fuzzyCompare(a->x, b->x) == 0 && fuzzyCompare(a->y, b->y) == -1); });
+		double fuzzyMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - fuzzyStart).count();
+		ThreadPool pool(maxThreads);
+		auto radixStart = std::chrono::steady_clock::now();
+		orderSites(radixSorted, pool);
+		double radixMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - radixStart).count();
+		std::cout << "site order: std::sort " << fuzzyMs << " ms, radix " << radixMs << " ms (" << maxThreads << " threads)"
+			<< (fuzzySorted == radixSorted ? "" : " ORDER MISMATCH") << std::endl;
+	}
+	if (GeometryKernel< int64_t >::accepts(cells, 0, cells.size())) {
+		// Ядро double против целочисленного на тех же сайтах, в один поток; топология должна совпасть
+		ThreadPool pool(1);
+		VoronoiDiagram doubleCopy(pool.size()), integerCopy(pool.size());
+		double doubleMs = build(pool, doubleCopy, voronoi< double >);
+		double integerMs = build(pool, integerCopy, voronoi< int64_t >);
+		std::cout << "kernel: double " << doubleMs << " ms, int64 " << integerMs << " ms"
+			<< (diagramHash(doubleCopy.cells, false) == diagramHash(integerCopy.cells, false) ? "" : " TOPOLOGY MISMATCH") << std::endl;
+	}
+	double base = 0;
+	uint64_t baseHash = 0;
+	for (uint32_t threads = 1; threads <= maxThreads; threads = threads < maxThreads ? std::min(threads * 2, maxThreads) : threads + 1) {
+		ThreadPool pool(threads);
+		VoronoiDiagram copy(pool.size());
+		double ms = build(pool, copy);
+		uint64_t hash = diagramHash(copy.cells);
+		if (threads == 1) {
+			base = ms;
+			baseHash = hash;
+		}
+		std::cout << "threads: " << threads << " time: " << ms << " ms speedup: " << base / ms << ", " << cells.size() / ms / 1000 << " Msites/s"
+			<< (hash == baseHash ? "" : " DIAGRAM MISMATCH") << std::endl;
 	}
 
-	time_t seed2 = seed;
-	std::cout << "Seed2: " << seed2 << std::endl; 
-	std::default_random_engine engine(seed2);
-    std::uniform_real_distribution<double> regionRand(-0.4 * REGION_SIZE, 0.4 * REGION_SIZE);
-	std::vector<int32_t> dx = {-1, -1, 1, 1}, dy = {-1, 1, 1, -1};
-	for (int32_t i = MAP_WIDTH; i < static_cast<int32_t>(tiles.size()) - MAP_WIDTH; ++i) {
-		if (i % MAP_WIDTH == 0 || i % MAP_WIDTH == MAP_WIDTH -1) continue;
-		int32_t moveX = 0, moveY = 0;
-		for (int32_t k = 0; k < 4; ++k) {
-			if (tiles[i + dx[k] + dy[k] * MAP_WIDTH] == tiles[i] && (tiles[i + dx[k]] != tiles[i] || tiles[i + dy[k] * MAP_WIDTH] != tiles[i])) {
-				moveX += dx[k];
-				moveY += dy[k];
-			} else if (tiles[i + dx[k] + dy[k] * MAP_WIDTH] != tiles[i] && tiles[i + dx[k]] != tiles[i] && tiles[i + dy[k] * MAP_WIDTH] != tiles[i]) {
-				moveX -= dx[k];
-				moveY -= dy[k];
-			}
+	ThreadPool pool(maxThreads);
+	double totalMs = 0;
+	long firstPeak = 0;
+	for (uint32_t r = 0; r < rebuilds; ++r) {
+		VoronoiDiagram copy(pool.size());
+		totalMs += build(pool, copy);
+		if (r == 0) {
+			firstPeak = peakMemoryKb();
 		}
-		cells[i]->x += round(moveX == 0 ? regionRand(engine) : (moveX < 0 ? -abs(regionRand(engine)) : abs(regionRand(engine))));
-		cells[i]->y += round(moveY == 0 ? regionRand(engine) : (moveY < 0 ? -abs(regionRand(engine)) : abs(regionRand(engine))));
 	}
-	for (int32_t i = 0; i < MAP_HEIGHT; ++i) {
-		cells.push_back(new Cell(-REGION_SIZE / 2, REGION_SIZE / 2 + i * REGION_SIZE));
-		cells.push_back(new Cell(REGION_SIZE / 2 + MAP_WIDTH * REGION_SIZE, REGION_SIZE / 2 + i * REGION_SIZE));
+	std::cout << "rebuilds: " << rebuilds << " x " << cells.size() << " sites, " << cells.size() * rebuilds / totalMs / 1000 << " Msites/s, peak RSS after first: "
+		<< firstPeak << " KB, after last: " << peakMemoryKb() << " KB" << std::endl;
+}
+
+// Полный обход диаграммы (периметры ячеек): граф указателей против плоских массивов
+void benchTraversal(const std::vector< Cell* >& cells, uint32_t repeats = 20) {
+	auto freezeStart = std::chrono::steady_clock::now();
+	FlatDiagram flat(cells);
+	double freezeMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - freezeStart).count();
+
+	double pointerSum = 0;
+	auto pointerStart = std::chrono::steady_clock::now();
+	for (uint32_t r = 0; r < repeats; ++r) {
+		for (auto cell : cells) {
+			auto curr = cell->head;
+			if (curr == nullptr) continue;
+			do {
+				auto start = curr->getStart(), end = curr->getEnd();
+				if (start != nullptr && end != nullptr) {
+					pointerSum += sqrt(start->distSqr(*end));
+				}
+				curr = curr->next;
+			} while (curr != cell->head);
+		}
 	}
-	for (int32_t j = 0; j < MAP_WIDTH; ++j) {
-		cells.push_back(new Cell(REGION_SIZE / 2 + j * REGION_SIZE, -REGION_SIZE / 2));
-		cells.push_back(new Cell(REGION_SIZE / 2 + j * REGION_SIZE, REGION_SIZE / 2 + MAP_HEIGHT * REGION_SIZE));
-	}
-	sort(cells.begin(), cells.end(), [](Cell* a, Cell* b) { return fuzzyCompare(a->x, b->x) == -1 || (fuzzyCompare(a->x, b->x) == 0 && fuzzyCompare(a->y, b->y) == -1); });
-	voronoi(cells, 0, cells.size());
-	std::cout << "voronoi ends" << std::endl;
-
-	std::vector<Vertex> vertices;
-	std::vector<uint32_t> indices;
-	std::vector<glm::vec3> normals; 
-	std::vector<std::pair<uint32_t, uint32_t>> eXv; 
-
-	int32_t vertIndex = MAP_WIDTH * MAP_HEIGHT + 1;
-	for (size_t i = 0; i < cells.size(); ++i) {
-		if (cells[i]->value == 0) continue;
-		float aNoiseVal = perlin.noise((cells[i]->x / REGION_SIZE) / 64.0, (cells[i]->y / REGION_SIZE) / 64.0, 3);
-		glm::vec3 aColor = MapTile::getColor(tiles[cells[i]->value - 1]);
-		// float tileHeight = tiles[cells[i]->value - 1] >= MapTile::MOUNTAIN ? 0 : 0.05;
-		// printCell(cells[i]);
-		auto curr = cells[i]->head;
-		Vertex a = { { 2 * cells[i]->x / (MAP_WIDTH * REGION_SIZE) - 1, 2 * cells[i]->y / (MAP_HEIGHT * REGION_SIZE) - 1, 1 - aNoiseVal, 0 }, aColor, {0, 0, 0}, { 0.0, 0.0, 0.0 }};
-		vertices.emplace_back(a);
-		uint32_t aIndex = vertices.size() - 1;
-		do {
-			auto start = curr->getStart();
-			auto end = curr->getEnd();
-			if (start != nullptr && end != nullptr) {
-				float bNoiseVal = perlin.noise((std::max(0.0, start->x) / REGION_SIZE) / 64.0, (std::max(0.0, start->y) / REGION_SIZE) / 64.0, 3);
-				float cNoiseVal = perlin.noise((std::max(0.0, end->x) / REGION_SIZE) / 64.0, (std::max(0.0, end->y) / REGION_SIZE) / 64.0, 3);
-				Vertex b = { { 2 * start->x / (MAP_WIDTH * REGION_SIZE)  - 1, 2 * start->y / (MAP_HEIGHT * REGION_SIZE) - 1, 1 - bNoiseVal, 0 }, aColor, {0, 0, 0}, { 0.0, 0.0, 0.0 } };
-				Vertex c = { { 2 * end->x / (MAP_WIDTH * REGION_SIZE)  - 1, 2 * end->y / (MAP_HEIGHT * REGION_SIZE) - 1, 1 - cNoiseVal, 0 }, aColor, {0, 0, 0}, { 0.0, 0.0, 0.0 } };
-				
-				glm::vec3 vec1 = { b.pos.x - a.pos.x, b.pos.y - a.pos.y, b.pos.z - a.pos.z };
-				glm::vec3 vec2 = { c.pos.x - a.pos.x, c.pos.y - a.pos.y, c.pos.z - a.pos.z };
-				glm::vec3 norm = glm::cross(vec1, vec2);
-				
-				if (start->index == 0) {
-					start->index = vertIndex++;
-					normals.push_back(norm);
-				} else {
-					normals[start->index - MAP_WIDTH * MAP_HEIGHT - 1] += norm;
+	double pointerMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - pointerStart).count() / repeats;
+
+	double flatSum = 0;
+	auto flatStart = std::chrono::steady_clock::now();
+	for (uint32_t r = 0; r < repeats; ++r) {
+		for (size_t c = 0; c < flat.cellCount(); ++c) {
+			for (uint32_t e = flat.cellEdges[c]; e < flat.cellEdges[c + 1]; ++e) {
+				uint32_t start = flat.edgeOrigin[e], end = flat.edgeEnd(e);
+				if (start != FlatDiagram::NONE && end != FlatDiagram::NONE) {
+					double dx = flat.vertexX[start] - flat.vertexX[end], dy = flat.vertexY[start] - flat.vertexY[end];
+					flatSum += sqrt(dx * dx + dy * dy);
 				}
-				if (end->index == 0) {
-					end->index = vertIndex++;
-					normals.push_back(norm);
-				} else {
-					normals[end->index - MAP_WIDTH * MAP_HEIGHT - 1] += norm;
+			}
+		}
+	}
+	double flatMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - flatStart).count() / repeats;
+
+	std::cout << "freeze: " << freezeMs << " ms, " << flat.edgeCount() << " edges, " << flat.vertexX.size() << " vertices, " << flat.bytes() / 1024 << " KB" << std::endl;
+	std::cout << "pointer traversal: " << pointerMs << " ms, flat traversal: " << flatMs << " ms, speedup: " << pointerMs / flatMs
+		<< (pointerSum == flatSum ? "" : " SUM MISMATCH") << std::endl;
+}
+
+// Оболочки convexHull (последовательно и в пуле) против монотонной цепочки на 1e3..1e7 точках трёх распределений
+void benchHull(uint32_t threads, size_t cutoff, size_t maxCount = 10000000) {
+	ThreadPool pool(threads);
+	const char* names[] = { "uniform", "clustered", "near-collinear" };
+	for (int distribution = 0; distribution < 3; ++distribution) {
+		for (size_t count = 1000; count <= maxCount; count *= 10) {
+			std::default_random_engine engine(1);
+			std::uniform_real_distribution< double > unit(0, 1);
+			std::normal_distribution< double > cluster(0, 0.01), offset(0, 1e-7);
+			std::vector< Point > points;
+			points.reserve(count);
+			std::vector< Point > centers;
+			for (int i = 0; i < 16; ++i) {
+				centers.emplace_back(unit(engine), unit(engine));
+			}
+			for (size_t i = 0; i < count; ++i) {
+				if (distribution == 0) { // равномерно в квадрате
+					points.emplace_back(unit(engine), unit(engine));
+				} else if (distribution == 1) { // 16 гауссовых скоплений
+					const Point& center = centers[i % centers.size()];
+					points.emplace_back(center.x + cluster(engine), center.y + cluster(engine));
+				} else { // вдоль прямой с отклонением ~1e-7
+					double x = unit(engine);
+					points.emplace_back(x, 0.5 * x + offset(engine));
 				}
-				vertices[aIndex].normal += norm;
-				vertices.emplace_back(b);
-				eXv.push_back(std::make_pair<uint32_t, uint32_t>(start->index - MAP_WIDTH * MAP_HEIGHT - 1, vertices.size() - 1));
-				vertices.emplace_back(c);
-				eXv.push_back(std::make_pair<uint32_t, uint32_t>(end->index - MAP_WIDTH * MAP_HEIGHT - 1, vertices.size() - 1));
-				indices.emplace_back(aIndex);
-				indices.emplace_back(vertices.size() - 2);
-				indices.emplace_back(vertices.size() - 1);
-
-				// if (tiles[cells[i]->value - 1] >= MapTile::MOUNTAIN && tiles[curr->twin->cell->value - 1] < MapTile::MOUNTAIN) {
-				// 	b.pos.z = c.pos.z = 0.05;
-				// 	c.color = b.color = {0.6, 0.6, 0.6};
-				// 	vertices.emplace_back(c);
-				// 	vertices.emplace_back(b);
-					
-				// 	index += 2;
-				// 	indices.emplace_back(index - 3);
-				// 	indices.emplace_back(index - 4);
-				// 	indices.emplace_back(index - 1);
-				// 	indices.emplace_back(index - 4);
-				// 	indices.emplace_back(index - 2);
-				// 	indices.emplace_back(index - 1);
-					
-				// }
 			}
-			curr = curr->next;
-		} while (curr != cells[i]->head);
+			size_t repeats = std::max< size_t >(1, 1000000 / count);
+			auto measure = [&](auto&& build, std::vector< uint32_t >& hull) {
+				auto start = std::chrono::steady_clock::now();
+				for (size_t r = 0; r < repeats; ++r) {
+					hull = build();
+				}
+				return std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count() / repeats;
+			};
+			std::vector< uint32_t > chainHull, sequentialHull, parallelHull;
+			double chainMs = measure([&] { return monotoneChainHull(points.data(), count); }, chainHull);
+			double sequentialMs = measure([&] { return convexHull(points.data(), count); }, sequentialHull);
+			double parallelMs = measure([&] { return convexHull(points.data(), count, &pool, cutoff); }, parallelHull);
+			std::cout << names[distribution] << " " << count << ": hull " << chainHull.size() << ", monotone chain " << chainMs << " ms (" << count / chainMs / 1000
+				<< " Mpoints/s), divide and conquer " << sequentialMs << " ms (" << count / sequentialMs / 1000 << " Mpoints/s), threads " << threads << ": "
+				<< parallelMs << " ms (" << count / parallelMs / 1000 << " Mpoints/s)" << (chainHull == sequentialHull && chainHull == parallelHull ? "" : " HULL MISMATCH") << std::endl;
+		}
 	}
-	for(size_t i = 0; i < eXv.size(); ++i) {
-		vertices[eXv[i].second].normal = normals[eXv[i].first];
+}
+
+// Точные предикаты против прежнего поворота с допуском EPS: время на вызов и число расхождений знака.
+// «решётка» - сайты карты (целые координаты), «вырожденные» - мелкая решётка, где почти все тройки коллинеарны
+// и четвёрки кокруговы (точный путь разложений), «почти коллинеарные» - отклонение от прямой ~1e-7
+void benchPredicates(size_t count = 1 << 20) {
+	auto orientationEps = [](const Point* a, const Point* b, const Point* c) {
+		double s = (b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x);
+		return s < -EPS ? -1 : (s > EPS ? 1 : 0);
+	};
+	const char* names[] = { "lattice", "degenerate", "near-collinear" };
+	for (int distribution = 0; distribution < 3; ++distribution) {
+		std::default_random_engine engine(1);
+		std::uniform_int_distribution< int32_t > lattice(0, MAP_WIDTH * REGION_SIZE), small(0, 4);
+		std::uniform_real_distribution< double > unit(0, 1);
+		std::normal_distribution< double > offset(0, 1e-7);
+		std::vector< Point > points;
+		points.reserve(count + 3);
+		for (size_t i = 0; i < count + 3; ++i) {
+			if (distribution == 0) {
+				points.emplace_back(lattice(engine), lattice(engine));
+			} else if (distribution == 1) {
+				points.emplace_back(small(engine), small(engine));
+			} else {
+				double x = unit(engine);
+				points.emplace_back(x, 0.5 * x + offset(engine));
+			}
+		}
+		auto measure = [&](auto&& predicate, std::vector< int8_t >& signs) {
+			signs.resize(count);
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < count; ++i) {
+				signs[i] = static_cast< int8_t >(predicate(&points[i], &points[i + 1], &points[i + 2], &points[i + 3]));
+			}
+			return std::chrono::duration< double, std::nano >(std::chrono::steady_clock::now() - start).count() / count;
+		};
+		std::vector< int8_t > epsSigns, exactSigns, filteredSigns, fullSigns;
+		double epsNs = measure([&](const Point* a, const Point* b, const Point* c, const Point*) { return orientationEps(a, b, c); }, epsSigns);
+		double exactNs = measure([](const Point* a, const Point* b, const Point* c, const Point*) { return Point::orientation(a, b, c); }, exactSigns);
+		double incircleNs = measure([](const Point* a, const Point* b, const Point* c, const Point* d) { return Point::incircle(a, b, c, d); }, filteredSigns);
+		double incircleExactNs = measure([](const Point* a, const Point* b, const Point* c, const Point* d) {
+			return incircleExact(a->x, a->y, b->x, b->y, c->x, c->y, d->x, d->y);
+		}, fullSigns);
+		size_t orientationDiffs = 0;
+		for (size_t i = 0; i < count; ++i) {
+			orientationDiffs += epsSigns[i] != exactSigns[i];
+		}
+		std::cout << names[distribution] << ": orientation with EPS " << epsNs << " ns, exact " << exactNs << " ns (" << orientationDiffs << " of " << count
+			<< " signs differ), incircle " << incircleNs << " ns, always exact " << incircleExactNs << " ns" << (filteredSigns == fullSigns ? "" : " INCIRCLE MISMATCH") << std::endl;
 	}
+}
 
+void benchPerlin(PerlinNoise2D& perlin, size_t count = 1 << 20) {
+	std::default_random_engine engine(1);
+	std::uniform_real_distribution< float > coord(0, MAP_WIDTH / 64.0f); // область шума, которую покрывает карта
+	std::vector< float > x(count), y(count), expected(count), actual(count);
+	for (size_t i = 0; i < count; ++i) {
+		x[i] = coord(engine);
+		y[i] = coord(engine);
+	}
+	const char* names[] = { "scalar", "sse2", "avx2" };
+	auto best = perlin.getKernel();
+	for (int32_t octaves : { 1, 3, 8 }) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count; ++i) {
+			expected[i] = perlin.noise(x[i], y[i], octaves);
+		}
+		double scalarMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count();
+		std::cout << "octaves " << octaves << ": noise " << count / scalarMs / 1000 << " Mpoints/s";
+		for (auto kernel : { PerlinNoise2D::Kernel::SCALAR, PerlinNoise2D::Kernel::SSE2, PerlinNoise2D::Kernel::AVX2 }) {
+			if (kernel > best) break;
+			perlin.setKernel(kernel);
+			start = std::chrono::steady_clock::now();
+			perlin.noiseBatch(x.data(), y.data(), actual.data(), count, octaves);
+			double batchMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count();
+			float maxDiff = 0;
+			for (size_t i = 0; i < count; ++i) {
+				maxDiff = std::max(maxDiff, std::abs(actual[i] - expected[i]));
+			}
+			std::cout << ", " << names[static_cast< int >(kernel)] << " " << count / batchMs / 1000 << " Mpoints/s (max diff " << maxDiff << ")";
+		}
+		std::cout << std::endl;
+	}
+	perlin.setKernel(best);
+
+	// Карта высот, как в VulkanEngine: 128 узлов на единицу, 3 октавы
+	HeightField heightField;
+	auto start = std::chrono::steady_clock::now();
+	heightField.build(perlin, MAP_WIDTH / 64.0f + 1, MAP_HEIGHT / 64.0f + 1, 128, 3);
+	double buildMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count();
+	for (size_t i = 0; i < count; ++i) {
+		expected[i] = perlin.noise(x[i], y[i], 3);
+	}
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		actual[i] = heightField.sample(x[i], y[i]);
+	}
+	double sampleMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count();
+	float maxDiff = 0;
+	for (size_t i = 0; i < count; ++i) {
+		maxDiff = std::max(maxDiff, std::abs(actual[i] - expected[i]));
+	}
+	std::cout << "height field: build " << buildMs << " ms, " << heightField.bytes() / 1024 << " KB, sample " << count / sampleMs / 1000
+		<< " Mpoints/s (max diff vs noise " << maxDiff << ")" << std::endl;
+}
+
+// Финиш и самолёт из LP_Airplane.obj после рельефа
+void appendObjects(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, PerlinNoise2D& perlin) {
 	auto tH = 1 - perlin.noise(MAP_WIDTH / 2 / 64, MAP_HEIGHT / 2 / 64, 3);
 	Vertex tA = { { 0, 0, tH, 2.0 }, {0, 0, 1}, {0, 0, 0}, {0, 0, 0} };
 	Vertex tB = { { -0.01, 0, tH - 0.1, 2.0 }, {0, 0, 1}, {0, 0, 0}, {0, 0, 0} };
@@ -500,14 +666,21 @@ int main(int argc, char** argv) {
 			
 		}
 	}
+}
 
-
-
-	VulkanEngine vulkanEngine(perlin, cells);
-	vulkanEngine.vertices = vertices;
-	vulkanEngine.indices = indices;
+int runEngine(VulkanEngine& vulkanEngine, uint32_t headlessFrames, const std::string& dumpPath, const std::string& profileCsv, const std::string& profileTrace) {
     try {
-        vulkanEngine.run();
+        if (headlessFrames > 0) {
+            vulkanEngine.runHeadless(headlessFrames, dumpPath);
+        } else {
+            vulkanEngine.run();
+        }
+        if (!profileCsv.empty()) {
+            vulkanEngine.profiler.writeCsv(profileCsv);
+        }
+        if (!profileTrace.empty()) {
+            vulkanEngine.profiler.writeTrace(profileTrace);
+        }
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;
@@ -515,6 +688,264 @@ int main(int argc, char** argv) {
 	return 0;
 }
 
+uint64_t indexCountOf(const std::vector< TerrainChunk >& chunks, uint32_t lod) {
+	uint64_t count = 0;
+	for (const TerrainChunk& chunk : chunks) {
+		if (chunk.lod == lod) count += chunk.indexCount;
+	}
+	return count;
+}
+
+// Грубый уровень детализации: ячейки регионов с i % step == j % step == step / 2 (1/4 ячеек при step = 2, 1/16 при step = 4)
+// со своей диаграммой; за краем карты - зеркальные копии крайних ячеек, чтобы граница диаграммы шла по краю карты.
+// Сетка обрезается по тем же чанкам, что и полный уровень
+TerrainMesh buildLodLevel(const std::vector< Cell* >& fineCells, const std::vector< MapTile::Type >& tiles, PerlinNoise2D& perlin, ThreadPool& pool, size_t cutoff, int32_t step, uint32_t lod) {
+	VoronoiDiagram diagram(pool.size());
+	int32_t first = step / 2, lastX = first + (MAP_WIDTH - 1 - first) / step * step, lastY = first + (MAP_HEIGHT - 1 - first) / step * step;
+	for (Cell* cell : fineCells) {
+		if (cell->value == 0) continue;
+		int32_t i = (cell->value - 1) / MAP_WIDTH, j = (cell->value - 1) % MAP_WIDTH;
+		if (i % step != first || j % step != first) continue;
+		diagram.addCell(cell->x, cell->y, cell->value, cell->index);
+		if (j == first) diagram.addCell(-cell->x, cell->y);
+		if (j == lastX) diagram.addCell(2.0 * MAP_WIDTH * REGION_SIZE - cell->x, cell->y);
+		if (i == first) diagram.addCell(cell->x, -cell->y);
+		if (i == lastY) diagram.addCell(cell->x, 2.0 * MAP_HEIGHT * REGION_SIZE - cell->y);
+	}
+	std::vector<Cell*>& cells = diagram.cells;
+	orderSites(cells, pool);
+	voronoi(cells, 0, cells.size(), diagram, pool, cutoff);
+	TerrainMesh mesh;
+	mesh.build(FlatDiagram(cells), tiles, perlin, pool);
+	mesh.clipToChunks(pool, lod, 2.0f * step / MAP_WIDTH);
+	return mesh;
+}
+
+int main(int argc, char** argv) {
+	// freopen("output.txt", "w", stdout);
+	uint32_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+	size_t cutoff = 4096;
+	bool benchmark = false;
+	bool benchmarkTraversal = false;
+	bool sharedVertices = false;
+	bool benchmarkPerlin = false;
+	bool benchmarkHull = false;
+	bool benchmarkPredicates = false;
+	bool prerecordCommands = false;
+	bool frustumCulling = true;
+	bool lodLevels = false;
+	float lodPixelError = 2;
+	int32_t streamRadius = 0;
+	FramePacer::Mode pacing = FramePacer::Mode::FIFO;
+	double targetFps = 0;
+	uint32_t headlessFrames = 0;
+	std::string dumpPath, profileCsv, profileTrace, cacheDirectory;
+	int32_t seed = time(0); //1685906448 1686078735 1686224088
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) {
+			threads = std::max(std::stoi(argv[++i]), 1);
+		} else if (arg == "--cutoff" && i + 1 < argc) {
+			cutoff = std::stoul(argv[++i]);
+		} else if (arg == "--bench-voronoi") {
+			benchmark = true;
+		} else if (arg == "--bench-traversal") {
+			benchmarkTraversal = true;
+		} else if (arg == "--bench-perlin") {
+			benchmarkPerlin = true;
+		} else if (arg == "--bench-hull") {
+			benchmarkHull = true;
+		} else if (arg == "--bench-predicates") {
+			benchmarkPredicates = true;
+		} else if (arg == "--shared-vertices") {
+			sharedVertices = true;
+		} else if (arg == "--headless" && i + 1 < argc) {
+			headlessFrames = std::stoul(argv[++i]);
+		} else if (arg == "--dump" && i + 1 < argc) {
+			dumpPath = argv[++i];
+		} else if (arg == "--pacing" && i + 1 < argc) {
+			pacing = FramePacer::parseMode(argv[++i]);
+		} else if (arg == "--target-fps" && i + 1 < argc) {
+			pacing = FramePacer::Mode::TARGET_FPS;
+			targetFps = std::stod(argv[++i]);
+		} else if (arg == "--lod") {
+			lodLevels = true;
+		} else if (arg == "--lod-error" && i + 1 < argc) {
+			lodLevels = true;
+			lodPixelError = std::stof(argv[++i]);
+		} else if (arg == "--stream" && i + 1 < argc) {
+			streamRadius = std::max(std::stoi(argv[++i]), 1); // радиус в плитках вокруг камеры
+		} else if (arg == "--no-culling") {
+			frustumCulling = false;
+		} else if (arg == "--prerecord") {
+			prerecordCommands = true;
+		} else if (arg == "--profile-csv" && i + 1 < argc) {
+			profileCsv = argv[++i];
+		} else if (arg == "--profile-trace" && i + 1 < argc) {
+			profileTrace = argv[++i];
+		} else if (arg == "--map-cache" && i + 1 < argc) {
+			cacheDirectory = argv[++i];
+		} else if (arg == "--seed" && i + 1 < argc) {
+			seed = std::stoi(argv[++i]); // для сравнения кадров между запусками
+		}
+	}
+	auto startupStart = std::chrono::steady_clock::now();
+	std::cout << "Seed: " << seed << std::endl;
+	PerlinNoise2D perlin(seed);
+	if (benchmarkPerlin) {
+		benchPerlin(perlin);
+		return 0;
+	}
+	if (benchmarkHull) {
+		benchHull(threads, cutoff);
+		return 0;
+	}
+	if (benchmarkPredicates) {
+		benchPredicates();
+		return 0;
+	}
+
+	// Кэш нужен только для обычного запуска: бенчмаркам нужна генерация, потоковой карте - её отсутствие
+	bool useCache = !cacheDirectory.empty() && streamRadius == 0 && !benchmark && !benchmarkTraversal;
+	MapCache cache(cacheDirectory, seed, (sharedVertices && !lodLevels ? MapCache::SHARED_VERTICES : 0) | (lodLevels ? MapCache::LOD : 0));
+	if (useCache && cache.load()) {
+		ThreadPool pool(threads);
+		std::vector<Cell*> noCells;
+		VulkanEngine vulkanEngine(perlin, noCells);
+		vulkanEngine.cached = cache.geometry();
+		vulkanEngine.chunks = cache.chunks();
+		vulkanEngine.frustumCulling = frustumCulling;
+		vulkanEngine.lodPixelError = lodPixelError;
+		vulkanEngine.prerecordCommands = prerecordCommands;
+		vulkanEngine.pacer.setMode(pacing, targetFps);
+		vulkanEngine.buildHeightField(&pool);
+		std::cout << "map cache hit: " << cache.path() << ", " << cache.bytes() / 1024 << " KB, startup (warm): "
+			<< std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - startupStart).count() << " ms" << std::endl;
+		return runEngine(vulkanEngine, headlessFrames, dumpPath, profileCsv, profileTrace);
+	}
+	perlin.saveImage(MAP_WIDTH, MAP_HEIGHT, 64, 3);
+
+	if (streamRadius > 0) {
+		// Карта не строится заранее: плитки генерирует TileStreamer, пока движок уже рисует
+		ThreadPool pool(threads);
+		TileStreamer streamer(perlin, seed, pool, streamRadius, [cutoff](VoronoiDiagram& diagram, ThreadPool& pool) {
+			voronoi(diagram.cells, 0, diagram.cells.size(), diagram, pool, cutoff);
+		});
+		std::vector<Cell*> noCells;
+		VulkanEngine vulkanEngine(perlin, noCells);
+		appendObjects(vulkanEngine.vertices, vulkanEngine.indices, perlin);
+		vulkanEngine.streamer = &streamer;
+		vulkanEngine.frustumCulling = frustumCulling;
+		vulkanEngine.prerecordCommands = prerecordCommands;
+		vulkanEngine.pacer.setMode(pacing, targetFps);
+		streamer.start();
+		return runEngine(vulkanEngine, headlessFrames, dumpPath, profileCsv, profileTrace);
+	}
+
+	VoronoiDiagram diagram(threads);
+	std::vector<Cell*>& cells = diagram.cells;
+	std::vector<MapTile::Type> tiles;
+	for (int32_t i = 0; i < MAP_HEIGHT; ++i) {
+		for (int32_t j = 0; j < MAP_WIDTH; ++j) {
+			diagram.addCell(REGION_SIZE / 2 + j * REGION_SIZE, REGION_SIZE / 2 + i * REGION_SIZE, i * MAP_WIDTH + j + 1, i * MAP_WIDTH + j + 1);
+			tiles.push_back(MapTile::getTile(perlin.noise(j / 64.0f, i / 64.0f, 3)));
+		}
+	}
+
+	time_t seed2 = seed;
+	std::cout << "Seed2: " << seed2 << std::endl; 
+	std::default_random_engine engine(seed2);
+    std::uniform_real_distribution<double> regionRand(-0.4 * REGION_SIZE, 0.4 * REGION_SIZE);
+	std::vector<int32_t> dx = {-1, -1, 1, 1}, dy = {-1, 1, 1, -1};
+	for (int32_t i = MAP_WIDTH; i < static_cast<int32_t>(tiles.size()) - MAP_WIDTH; ++i) {
+		if (i % MAP_WIDTH == 0 || i % MAP_WIDTH == MAP_WIDTH -1) continue;
+		int32_t moveX = 0, moveY = 0;
+		for (int32_t k = 0; k < 4; ++k) {
+			if (tiles[i + dx[k] + dy[k] * MAP_WIDTH] == tiles[i] && (tiles[i + dx[k]] != tiles[i] || tiles[i + dy[k] * MAP_WIDTH] != tiles[i])) {
+				moveX += dx[k];
+				moveY += dy[k];
+			} else if (tiles[i + dx[k] + dy[k] * MAP_WIDTH] != tiles[i] && tiles[i + dx[k]] != tiles[i] && tiles[i + dy[k] * MAP_WIDTH] != tiles[i]) {
+				moveX -= dx[k];
+				moveY -= dy[k];
+			}
+		}
+		cells[i]->x += round(moveX == 0 ? regionRand(engine) : (moveX < 0 ? -abs(regionRand(engine)) : abs(regionRand(engine))));
+		cells[i]->y += round(moveY == 0 ? regionRand(engine) : (moveY < 0 ? -abs(regionRand(engine)) : abs(regionRand(engine))));
+	}
+	for (int32_t i = 0; i < MAP_HEIGHT; ++i) {
+		diagram.addCell(-REGION_SIZE / 2, REGION_SIZE / 2 + i * REGION_SIZE);
+		diagram.addCell(REGION_SIZE / 2 + MAP_WIDTH * REGION_SIZE, REGION_SIZE / 2 + i * REGION_SIZE);
+	}
+	for (int32_t j = 0; j < MAP_WIDTH; ++j) {
+		diagram.addCell(REGION_SIZE / 2 + j * REGION_SIZE, -REGION_SIZE / 2);
+		diagram.addCell(REGION_SIZE / 2 + j * REGION_SIZE, REGION_SIZE / 2 + MAP_HEIGHT * REGION_SIZE);
+	}
+	ThreadPool pool(threads);
+	auto orderStart = std::chrono::steady_clock::now();
+	size_t duplicates = orderSites(cells, pool);
+	std::cout << "sites ordered: " << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - orderStart).count() << " ms, " << cells.size() << " sites, " << duplicates << " duplicates removed" << std::endl;
+	if (benchmark) {
+		benchVoronoi(cells, cutoff, threads);
+		return 0;
+	}
+	auto voronoiStart = std::chrono::steady_clock::now();
+	voronoi(cells, 0, cells.size(), diagram, pool, cutoff);
+	std::cout << "voronoi ends: " << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - voronoiStart).count() << " ms, threads: " << threads << ", diagram: " << diagram.bytes() / 1024 << " KB, peak RSS: " << peakMemoryKb() << " KB" << std::endl;
+	if (benchmarkTraversal) {
+		benchTraversal(cells);
+		return 0;
+	}
+
+	auto meshStart = std::chrono::steady_clock::now();
+	TerrainMesh mesh;
+	FlatDiagram flat(cells);
+	mesh.build(flat, tiles, perlin, pool, sharedVertices && !lodLevels);
+	if (lodLevels) {
+		// Уровни 1 и 2 строятся одновременно с обрезкой полного уровня, затем всё склеивается в один буфер
+		auto lodStart = std::chrono::steady_clock::now();
+		TerrainMesh half, quarter;
+		pool.invoke([&] {
+			pool.invoke([&] { mesh.clipToChunks(pool, 0, 0); }, [&] { half = buildLodLevel(cells, tiles, perlin, pool, cutoff, 2, 1); });
+		}, [&] { quarter = buildLodLevel(cells, tiles, perlin, pool, cutoff, 4, 2); });
+		for (TerrainMesh* level : { &half, &quarter }) {
+			uint32_t vertexOffset = static_cast< uint32_t >(mesh.vertices.size()), indexOffset = static_cast< uint32_t >(mesh.indices.size());
+			mesh.vertices.insert(mesh.vertices.end(), level->vertices.begin(), level->vertices.end());
+			for (uint32_t index : level->indices) {
+				mesh.indices.push_back(vertexOffset + index);
+			}
+			for (TerrainChunk chunk : level->chunks) {
+				chunk.firstIndex += indexOffset;
+				mesh.chunks.push_back(chunk);
+			}
+		}
+		std::cout << "lod ends: " << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - lodStart).count() << " ms, triangles per level: "
+			<< indexCountOf(mesh.chunks, 0) / 3 << " / " << indexCountOf(mesh.chunks, 1) / 3 << " / " << indexCountOf(mesh.chunks, 2) / 3 << std::endl;
+	}
+	std::vector<Vertex> vertices = std::move(mesh.vertices);
+	std::vector<uint32_t> indices = std::move(mesh.indices);
+	std::vector<TerrainChunk> chunks = std::move(mesh.chunks);
+	std::cout << "mesh ends: " << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - meshStart).count() << " ms, " << (sharedVertices && !lodLevels ? "shared" : "per-triangle") << " vertices: " << vertices.size()
+		<< " (" << vertices.size() * sizeof(Vertex) / 1024 << " KB), indices: " << indices.size() << " (" << indices.size() * sizeof(uint32_t) / 1024 << " KB)" << std::endl;
+
+	appendObjects(vertices, indices, perlin);
+	if (useCache) {
+		cache.save(vertices, indices, chunks, flat);
+		std::cout << "map cache saved: " << cache.path() << std::endl;
+	}
+
+	VulkanEngine vulkanEngine(perlin, cells);
+	vulkanEngine.vertices = std::move(vertices);
+	vulkanEngine.indices = std::move(indices);
+	vulkanEngine.chunks = std::move(chunks);
+	vulkanEngine.frustumCulling = frustumCulling;
+	vulkanEngine.lodPixelError = lodPixelError;
+	vulkanEngine.prerecordCommands = prerecordCommands;
+	vulkanEngine.pacer.setMode(pacing, targetFps);
+	vulkanEngine.buildHeightField(&pool);
+	std::cout << "startup (cold): " << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - startupStart).count() << " ms" << std::endl;
+	return runEngine(vulkanEngine, headlessFrames, dumpPath, profileCsv, profileTrace);
+}
+
 /*
 Seed: 1685904510
 Seed2: 1685904510
@@ -1,7 +1,16 @@
+#pragma once
+
+#include <algorithm>
 #include <memory>
 #include <cmath>
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <optional>
+#include <new>
+#include <type_traits>
+
+#include "predicates.h"
 
 const double EPS = 1e-9;
 
@@ -23,7 +32,7 @@ class Point {
             return (x - p.x) * (x - p.x) + (y - p.y) * (y - p.y);
         }
         
-		bool fuzzyEquals(const Point* other) {
+		bool fuzzyEquals(const Point* other) const {
         	return other != nullptr && fuzzyCompare(x, other->x) == 0 && fuzzyCompare(y, other->y) == 0;
 		}
 
@@ -31,10 +40,16 @@ class Point {
 			return "(" + std::to_string(x) + ", " + std::to_string(y) + ")";
 		}
 
-		static int orientation(Point* a, Point* b, Point* c) {
-            double s = (b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x);
-            return s < -EPS ? -1 : (s > EPS ? 1 : 0); // -1 правее(cw) a b, 0 на линии, 1 левее(ccw) a b
-        }
+		// -1 правее(cw) a b, 0 точно на линии, 1 левее(ccw) a b. Знак точный (predicates.h): допуск EPS склеивал разные повороты
+		// на плотных и почти коллинеарных наборах, и слияние оболочек могло зациклиться
+		static int orientation(const Point* a, const Point* b, const Point* c) {
+			return orient2d(a->x, a->y, b->x, b->y, c->x, c->y);
+		}
+
+		// 1 - d внутри окружности через a, b, c (обходящие её против часовой), -1 - снаружи, 0 - точно на ней
+		static int incircle(const Point* a, const Point* b, const Point* c, const Point* d) {
+			return ::incircle(a->x, a->y, b->x, b->y, c->x, c->y, d->x, d->y);
+		}
 };
 
 class HalfEdge;
@@ -56,25 +71,31 @@ class Line {
 		
 		Line(double x1, double y1, double x2, double y2) : a(y2 - y1), b(x1 - x2), c(-a * x1 - b * y1) {}
 		
-		bool isParallel(const Line& line) {
-			return fuzzyCompare(a * line.b, line.a * b) == 0;
+		// Сравнения произведений коэффициентов относительные: абсолютный допуск fuzzyCompare при мелком шаге сайтов
+		// (коэффициенты порядка 1e-5) считал параллельными почти все прямые
+		bool isParallel(const Line& line) const {
+			return nearlyEqual(a * line.b, line.a * b);
 		}
 		
-		bool isEqual(const Line& line) {
-			return fuzzyCompare(a * line.b, line.a * b) == 0 
-				&& fuzzyCompare(a * line.c, line.a * c) == 0
-				&& fuzzyCompare(b * line.c, line.b * c) == 0;
+		bool isEqual(const Line& line) const {
+			return nearlyEqual(a * line.b, line.a * b)
+				&& nearlyEqual(a * line.c, line.a * c)
+				&& nearlyEqual(b * line.c, line.b * c);
 		}
 		
-		std::shared_ptr< Point > intersection(const Line& line) {
+		std::optional< Point > intersection(const Line& line) {
 			if (isParallel(line) || isEqual(line)) {
-				return nullptr;
+				return std::nullopt;
 			}
 			double px = (line.b * c - b * line.c) / (line.a * b - a * line.b);
         	double py = fuzzyCompare(b, 0) != 0 ? (-c - a * px) / b : (-line.c - line.a * px) / line.b;
-			return std::make_shared< Point >(px, py);
+			return Point(px, py);
 		}
 		
+		static bool nearlyEqual(double u, double v) {
+			return std::abs(u - v) <= EPS * std::max(std::abs(u), std::abs(v));
+		}
+
 		static Line perpendicular(const Point& p1, const Point& p2, const Point& p) {
 			double a = p2.y - p1.y, b = p1.x - p2.x;
 			return Line(b, -a, -b * p.x + a * p.y);
@@ -92,7 +113,7 @@ class HalfEdge {
 		HalfEdge* prev = nullptr;
 		HalfEdge* twin;
 
-		HalfEdge(std::shared_ptr< Point > source, Cell* cell) : source(source), cell(cell) {}
+		HalfEdge(Point* source, Cell* cell) : source(source), cell(cell) {}
 
 		std::string toString() {
 
@@ -101,26 +122,35 @@ class HalfEdge {
 				+ " end: " + (getEnd() != nullptr ? (std::to_string(getEnd()->x) + " " + std::to_string(getEnd()->y)) : getLine().toString());
 		}
 
-		std::shared_ptr< Point > getStart() {
+		Point* getStart() {
         	return source->value == 0 ? source : nullptr;
     	}
 
-    	std::shared_ptr< Point > getEnd() {
+    	Point* getEnd() {
         	return twin->source->value == 0 ? twin->source : nullptr;
     	}
 
-		void setStart(std::shared_ptr< Point > p) {
+		// Точки-направления принадлежат только ребру и его двойнику, вытесненные возвращаются в storage
+		template < typename Storage >
+		void setStart(Point* p, Storage& storage) {
 			if (twin->source->value < 0) {
 				source->value = abs(twin->source->value);
+				storage.releasePoint(twin->source);
 				twin->source = source;
+			} else if (source->value != 0 && source != twin->source) {
+				storage.releasePoint(source);
 			}
 			source = p;
 		}
 
-		void setEnd(std::shared_ptr< Point > p) {
+		template < typename Storage >
+		void setEnd(Point* p, Storage& storage) {
 			if (source->value < 0) {
 				twin->source->value = abs(source->value);
+				storage.releasePoint(source);
 				source = twin->source;
+			} else if (twin->source->value != 0 && twin->source != source) {
+				storage.releasePoint(twin->source);
 			}
 			twin->source = p;
 		}
@@ -185,23 +215,180 @@ class HalfEdge {
             }
 		}
 
-		static HalfEdge* createEdge(std::shared_ptr< Point > p1, std::shared_ptr< Point > p2, const Line& l, Cell* left, Cell* right) {
+		template < typename Storage >
+		static HalfEdge* createEdge(Point* p1, Point* p2, const Line& l, Cell* left, Cell* right, Storage& storage) {
 			int q = (l.a > 0 && l.b > 0) || (l.a < 0 && l.b < 0) || fuzzyCompare(l.a, 0) == 0 ? 4 : 3;
 			if (p1 == nullptr) {
-				p1 =  std::make_shared< Point >(l.a, l.b, q - 2);
+				p1 = storage.createPoint(l.a, l.b, q - 2);
 				if (p2 == nullptr) {
-					p2 =  std::make_shared< Point >(l.c, 0, -q);
+					p2 = storage.createPoint(l.c, 0, -q);
 				}
 			} else if (p2 == nullptr) {
-				p2 =  std::make_shared< Point >(l.a, l.b, q);
+				p2 = storage.createPoint(l.a, l.b, q);
 			}
-			HalfEdge* leftEdge = new HalfEdge(p1, left);
-			HalfEdge* rightEdge = new HalfEdge(p2, right);
+			HalfEdge* leftEdge = storage.createEdge(p1, left);
+			HalfEdge* rightEdge = storage.createEdge(p2, right);
 			leftEdge->twin = rightEdge->next = rightEdge->prev = rightEdge;
 			rightEdge->twin = leftEdge->next = leftEdge->prev = leftEdge;
 			return leftEdge;
 		}
 
 	private:
-		std::shared_ptr< Point > source;
+		Point* source;
+};
+
+
+// Блочный пул объектов: адреса стабильны, память освобождается целиком вместе с пулом
+template < typename T >
+class ObjectPool {
+	static_assert(std::is_trivially_destructible< T >::value, "ObjectPool does not call destructors");
+
+	public:
+		explicit ObjectPool(size_t blockSize = 4096) : blockSize(blockSize) {}
+
+		ObjectPool(const ObjectPool&) = delete;
+		ObjectPool& operator=(const ObjectPool&) = delete;
+		ObjectPool(ObjectPool&&) = default;
+		ObjectPool& operator=(ObjectPool&&) = default;
+
+		template < typename... Args >
+		T* create(Args&&... args) {
+			if (!freeList.empty()) {
+				T* object = freeList.back();
+				freeList.pop_back();
+				return new (object) T(std::forward< Args >(args)...);
+			}
+			if (blocks.empty() || used == blockSize) {
+				blocks.emplace_back(new Slot[blockSize]);
+				used = 0;
+			}
+			return new (&blocks.back()[used++]) T(std::forward< Args >(args)...);
+		}
+
+		// Объект возвращается в пул и будет переиспользован следующим create
+		void release(T* object) {
+			freeList.push_back(object);
+		}
+
+		size_t size() const {
+			return blocks.empty() ? 0 : (blocks.size() - 1) * blockSize + used - freeList.size();
+		}
+
+		size_t capacityBytes() const {
+			return blocks.size() * blockSize * sizeof(Slot);
+		}
+
+	private:
+		struct alignas(T) Slot {
+			unsigned char data[sizeof(T)];
+		};
+
+		size_t blockSize;
+		size_t used = 0;
+		std::vector< std::unique_ptr< Slot[] > > blocks;
+		std::vector< T* > freeList;
+};
+
+// Выпуклые оболочки при слиянии: узел - номер точки в отсортированном массиве, next / prev - номера соседей.
+// Массивы на все точки выделяются один раз; половины при параллельной сборке пишут в непересекающиеся диапазоны номеров
+struct HullNodes {
+	std::vector< uint32_t > next;
+	std::vector< uint32_t > prev;
+
+	// Размер не уменьшается, поэтому повторные сборки того же размера не выделяют память
+	void reserve(size_t count) {
+		if (next.size() < count) {
+			next.resize(count);
+			prev.resize(count);
+		}
+	}
+
+	uint32_t makeNode(uint32_t i) {
+		return next[i] = prev[i] = i;
+	}
+
+	size_t bytes() const {
+		return (next.capacity() + prev.capacity()) * sizeof(uint32_t);
+	}
+};
+
+// Память для вершин и полуребер, принадлежащая одному потоку сборки
+class DiagramStorage {
+	public:
+		Point* createPoint(double x, double y, int32_t value = 0) {
+			return points.create(x, y, value);
+		}
+
+		void releasePoint(Point* point) {
+			points.release(point);
+		}
+
+		HalfEdge* createEdge(Point* source, Cell* cell) {
+			return edges.create(source, cell);
+		}
+
+		// Ребро удаляется из диаграммы, но на него ещё могут ссылаться до конца слияния
+		void retire(HalfEdge* edge) {
+			retired.push_back(edge);
+		}
+
+		void recycle() {
+			for (auto edge : retired) {
+				edges.release(edge);
+			}
+			retired.clear();
+		}
+
+		// Стек слияния оболочек, переиспользуется всеми слияниями этого потока
+		std::vector< uint32_t >& hullStack() {
+			return stack;
+		}
+
+		size_t bytes() const {
+			return points.capacityBytes() + edges.capacityBytes() + stack.capacity() * sizeof(uint32_t);
+		}
+
+	private:
+		ObjectPool< Point > points;
+		ObjectPool< HalfEdge > edges;
+		std::vector< HalfEdge* > retired;
+		std::vector< uint32_t > stack;
+};
+
+// Диаграмма Вороного владеет ячейками, вершинами и полуребрами; всё освобождается в деструкторе.
+// slots - число потоков сборки, каждый поток пишет только в свой DiagramStorage.
+class VoronoiDiagram {
+	public:
+		std::vector< Cell* > cells;
+		HullNodes hull; // по узлу на ячейку cells, заполняется при сборке
+
+		explicit VoronoiDiagram(uint32_t threads = 1) : slots(std::max(threads, 1u)) {}
+
+		VoronoiDiagram(const VoronoiDiagram&) = delete;
+		VoronoiDiagram& operator=(const VoronoiDiagram&) = delete;
+
+		Cell* addCell(double x, double y, int32_t value = 0, uint32_t index = 0) {
+			cells.push_back(cellPool.create(x, y, value, index));
+			return cells.back();
+		}
+
+		DiagramStorage& storage(uint32_t slot = 0) {
+			return slots[slot];
+		}
+
+		uint32_t slotCount() const {
+			return static_cast< uint32_t >(slots.size());
+		}
+
+		size_t bytes() const {
+			size_t total = cellPool.capacityBytes() + hull.bytes();
+			for (const auto& slot : slots) {
+				total += slot.bytes();
+			}
+			return total;
+		}
+
+	private:
+		ObjectPool< Cell > cellPool;
+		std::vector< DiagramStorage > slots;
 };
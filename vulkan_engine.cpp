@@ -5,13 +5,18 @@
 #include <cstdint>
 #include <limits>
 #include <set>
+#include <map>
 #include <chrono>
 #include <thread>
 
+#include "tile_streamer.h"
 #include "voronoi_structs.h"
 #include "vulkan_engine.h"
 
 void VulkanEngine::run() {
+    if (heightField.empty() && streamer == nullptr) {
+        buildHeightField();
+    }
     initWindow();
     initVulkan();
     std::thread draw(&VulkanEngine::drawLoop, this);
@@ -20,6 +25,99 @@ void VulkanEngine::run() {
     cleanup();
 }
 
+void VulkanEngine::runHeadless(uint32_t frames, const std::string& dumpPath) {
+    headless = true;
+    if (heightField.empty() && streamer == nullptr) {
+        buildHeightField();
+    }
+    initVulkan();
+
+    // Прогон делится на отрезки с разным сдвигом рельефа по z (колесо мыши): ближе к камере и дальше от неё
+    const std::array< float, 4 > ZOOM_OFFSETS = { 0.0f, 0.5f, -1.0f, -2.0f };
+    const uint32_t ZOOM_LEVELS = static_cast< uint32_t >(ZOOM_OFFSETS.size());
+    std::vector< double > zoomTriangles(ZOOM_LEVELS, 0);
+    std::vector< uint32_t > zoomFrames(ZOOM_LEVELS, 0);
+    auto runStart = std::chrono::steady_clock::now();
+    for (uint32_t frame = 0; frame < frames; ++frame) {
+        uint32_t zoom = frame * ZOOM_LEVELS / frames;
+        uint64_t profiledFrame = profiler.beginFrame();
+        {
+            auto scope = profiler.scope(FrameProfiler::FENCE_WAIT);
+            vkWaitForFences(vulkanDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        }
+        collectGpuTime(currentFrame);
+
+        // Путь камеры: полный круг за прогон, финиш медленно сдвигается, чтобы самолёт пересчитывал маршрут
+        float angle = 2 * static_cast< float >(M_PI) * frame / frames;
+        moveX = std::cos(angle);
+        moveY = std::sin(angle);
+        finishMoveX = frame < frames / 2 ? 1 : 0;
+        moveZ = zoom > 0 && (frame - 1) * ZOOM_LEVELS / frames != zoom ? (ZOOM_OFFSETS[zoom - 1] - ZOOM_OFFSETS[zoom]) * 100 : 0;
+        {
+            auto scope = profiler.scope(FrameProfiler::UPDATE);
+            updateUniformBuffer(currentFrame); // ровно один шаг за кадр: путь прогона не зависит от скорости машины
+        }
+        {
+            auto scope = profiler.scope(FrameProfiler::STREAM);
+            streamTiles();
+        }
+        {
+            auto scope = profiler.scope(FrameProfiler::CULL);
+            uint64_t triangles = cullChunks(currentFrame);
+            profiler.setTriangles(triangles);
+            zoomTriangles[zoom] += triangles;
+            ++zoomFrames[zoom];
+        }
+        vkResetFences(vulkanDevice, 1, &inFlightFences[currentFrame]);
+        VkCommandBuffer commandBuffer = frameCommandBuffer(0);
+        {
+            auto scope = profiler.scope(FrameProfiler::SUBMIT);
+            VkSubmitInfo submitInfo{};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &commandBuffer;
+            if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to submit draw command buffer!");
+            }
+        }
+        submittedFrames[currentFrame] = static_cast< int64_t >(profiledFrame);
+        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    }
+    vkDeviceWaitIdle(vulkanDevice);
+    double totalMs = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - runStart).count();
+    for (uint32_t slot = 0; slot < MAX_FRAMES_IN_FLIGHT; ++slot) {
+        collectGpuTime(slot);
+    }
+
+    profiler.writeCsv(std::cout);
+    std::cout << "headless: " << frames << " frames " << swapChainExtent.width << "x" << swapChainExtent.height << ", " << (totalMs > 0 ? frames * 1000.0 / totalMs : 0) << " fps, ";
+    profiler.report(std::cout);
+    std::cout << std::endl;
+    for (uint32_t zoom = 0; zoom < ZOOM_LEVELS; ++zoom) {
+        if (zoomFrames[zoom] == 0) continue;
+        std::cout << "zoom offset " << ZOOM_OFFSETS[zoom] << ": " << zoomTriangles[zoom] / zoomFrames[zoom] << " triangles drawn of " << indexCount() / 3 << std::endl;
+    }
+    if (!dumpPath.empty()) {
+        dumpOffscreen(dumpPath);
+    }
+    cleanup();
+}
+
+void VulkanEngine::buildHeightField(ThreadPool* pool) {
+    auto start = std::chrono::steady_clock::now();
+    heightField.build(perlin, MAP_WIDTH / 64.0f + 1, MAP_HEIGHT / 64.0f + 1, HEIGHT_FIELD_RESOLUTION, 3, pool); // с запасом за краем карты
+    std::cout << "height field: " << heightField.getColumns() << "x" << heightField.getRows() << ", " << heightField.bytes() / 1024 << " KB, "
+        << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+}
+
+// Высота рельефа (1 - шум) в точке карты, x и y в [-1, 1]
+float VulkanEngine::terrainHeight(float x, float y) const {
+    if (streamer != nullptr) {
+        return 1 - streamer->height(x, y);
+    }
+    return 1 - heightField.sample(std::max(0.0f, (x + 1) * MAP_WIDTH / 2 / 64), std::max(0.0f, (y + 1) * MAP_HEIGHT / 2 / 64));
+}
+
 void VulkanEngine::initWindow() {
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         throw std::runtime_error(SDL_GetError());
@@ -32,10 +130,17 @@ void VulkanEngine::initWindow() {
 
 void VulkanEngine::initVulkan() {
     createInstance();
-    createSurface();
+    if (!headless) {
+        createSurface();
+    }
     pickPhysicalDevice();
     createLogicalDevice();
-    createSwapChain();
+    allocator.init(vulkanDevice, physicalDevice);
+    if (headless) {
+        createOffscreenTarget();
+    } else {
+        createSwapChain();
+    }
     createImageViews();
     createRenderPass();
     createDescriptorSetLayout();
@@ -43,22 +148,37 @@ void VulkanEngine::initVulkan() {
     createCommandPool();
     createDepthResources();
     createFramebuffers();
-    createVertexBuffer();
-    createIndexBuffer();
+    auto uploadStart = std::chrono::steady_clock::now();
+    if (streamer != nullptr) { // при сдвиге на плитку освобождается ряд, занять его места можно только через кадры в полёте
+        streamSlots.resize(streamer->capacity() + MAX_FRAMES_IN_FLIGHT * (2 * streamer->getRadius() + 1));
+    }
+    createGeometryBuffers();
+    createIndirectBuffers();
+    std::cout << "vertex buffer: " << sizeof(GpuVertex) * vertexCount() / 1024 << " KB, index buffer: " << sizeof(uint32_t) * indexCount() / 1024
+        << " KB, upload: " << std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - uploadStart).count() << " ms" << std::endl;
     createUniformBuffers();
     createDescriptorPool();
     createDescriptorSets();
     createCommandBuffer();
     createSyncObjects();
+    createTimestampPool();
+    if (prerecordCommands) {
+        createStaticCommandBuffers();
+    }
+    allocator.trim();
+    allocator.print(std::cout);
 }
 
 void VulkanEngine::inputLoop() {
     SDL_Event event;
     while(SDL_WaitEvent(&event)) {
         switch (event.type) {
-            case SDL_QUIT:
+            case SDL_QUIT: {
+                std::lock_guard< std::mutex > lock(windowMutex);
                 running = false;
+                windowCv.notify_all(); // поток рисования может ждать разворачивания окна
                 return;
+            }
             case SDL_MOUSEBUTTONUP:
                 if (event.button.button == SDL_BUTTON_LEFT) {
                     moveX = moveY = 0;
@@ -93,6 +213,12 @@ void VulkanEngine::inputLoop() {
             case SDL_MOUSEWHEEL: 
                 moveZ = event.wheel.y;
                 break;
+            case SDL_WINDOWEVENT:
+                if (event.window.event == SDL_WINDOWEVENT_MINIMIZED) {
+                    windowVisible = false; // поток рисования ждёт на windowCv, пока окно не развернут
+                    break;
+                }
+                [[fallthrough]];
             default:
                 if (!windowVisible) {
                     std::lock_guard< std::mutex > lock(windowMutex);
@@ -110,22 +236,38 @@ void VulkanEngine::inputLoop() {
 
 void VulkanEngine::drawLoop() {
     while (running) {
+        if (!windowVisible) {
+            std::unique_lock lock(windowMutex);
+            windowCv.wait(lock, [this] { return windowVisible || !running; });
+            pacer.reset();
+            continue;
+        }
         drawFrame();
+        pacer.wait();
     }
     vkDeviceWaitIdle(vulkanDevice);
 }
 
 void VulkanEngine::cleanupSwapChain() {
+    if (!staticCommandBuffers.empty()) {
+        vkFreeCommandBuffers(vulkanDevice, commandPool, static_cast< uint32_t >(staticCommandBuffers.size()), staticCommandBuffers.data());
+        staticCommandBuffers.clear();
+    }
     vkDestroyImageView(vulkanDevice, depthImageView, nullptr);
     vkDestroyImage(vulkanDevice, depthImage, nullptr);
-    vkFreeMemory(vulkanDevice, depthImageMemory, nullptr);
+    allocator.free(depthImageMemory);
     for (auto framebuffer : swapChainFramebuffers) {
         vkDestroyFramebuffer(vulkanDevice, framebuffer, nullptr);
     }
     for (auto imageView : swapChainImageViews) {
         vkDestroyImageView(vulkanDevice, imageView, nullptr);
     }
-    vkDestroySwapchainKHR(vulkanDevice, swapChain, nullptr);
+    if (headless) {
+        vkDestroyImage(vulkanDevice, swapChainImages[0], nullptr);
+        allocator.free(offscreenImageMemory);
+    } else {
+        vkDestroySwapchainKHR(vulkanDevice, swapChain, nullptr);
+    }
 }
 
 void VulkanEngine::cleanup() {
@@ -137,7 +279,7 @@ void VulkanEngine::cleanup() {
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
         for (size_t k = 0; k < ubo.size(); ++k) {
             vkDestroyBuffer(vulkanDevice, ubo[k].uniformBuffers[i], nullptr);
-            vkFreeMemory(vulkanDevice, ubo[k].uniformBuffersMemory[i], nullptr);
+            allocator.free(ubo[k].uniformBuffersMemory[i]);
         }
     }
 
@@ -145,16 +287,24 @@ void VulkanEngine::cleanup() {
     for (size_t i = 0; i < descriptorSetLayout.size(); ++i) {
         vkDestroyDescriptorSetLayout(vulkanDevice, descriptorSetLayout[i], nullptr);
     }
+    for (size_t i = 0; i < indirectBuffers.size(); ++i) {
+        vkDestroyBuffer(vulkanDevice, indirectBuffers[i], nullptr);
+        allocator.free(indirectBuffersMemory[i]);
+    }
     vkDestroyBuffer(vulkanDevice, indexBuffer, nullptr);
-    vkFreeMemory(vulkanDevice, indexBufferMemory, nullptr);
+    allocator.free(indexBufferMemory);
     vkDestroyBuffer(vulkanDevice, vertexBuffer, nullptr);
-    vkFreeMemory(vulkanDevice, vertexBufferMemory, nullptr);
+    allocator.free(vertexBufferMemory);
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
         vkDestroySemaphore(vulkanDevice, renderFinishedSemaphores[i], nullptr);
         vkDestroySemaphore(vulkanDevice, imageAvailableSemaphores[i], nullptr);
         vkDestroyFence(vulkanDevice, inFlightFences[i], nullptr);
     }
+    if (timestampPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(vulkanDevice, timestampPool, nullptr);
+    }
     vkDestroyCommandPool(vulkanDevice, commandPool, nullptr);
+    allocator.destroy();
     vkDestroyDevice(vulkanDevice, nullptr);
     if (ENABLE_VALIDATION_LAYERS) {
         auto func = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
@@ -162,7 +312,9 @@ void VulkanEngine::cleanup() {
             func(instance, debugMessenger, nullptr);
         }
     }
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (surface != VK_NULL_HANDLE) {
+        vkDestroySurfaceKHR(instance, surface, nullptr);
+    }
     vkDestroyInstance(instance, nullptr);
     if (window != nullptr) {
         SDL_DestroyWindow(window);
@@ -253,6 +405,10 @@ void VulkanEngine::pickPhysicalDevice() {
     }
     for (const auto& device : devices) {
         QueueFamilyIndices indices = findQueueFamilies(device);
+        if (indices.isComplete() && headless) {
+            physicalDevice = device; // без окна swapchain не нужен, хватает графической очереди
+            break;
+        }
         if (indices.isComplete()) {
             uint32_t extensionCount;
             vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
@@ -291,13 +447,17 @@ void VulkanEngine::createLogicalDevice() {
         queueCreateInfos.push_back(queueCreateInfo);
     }
 
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
     VkPhysicalDeviceFeatures deviceFeatures{};
+    deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+    multiDrawIndirect = supportedFeatures.multiDrawIndirect == VK_TRUE;
     VkDeviceCreateInfo deviceCreateInfo{};
     deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     deviceCreateInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     deviceCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
     deviceCreateInfo.pEnabledFeatures = &deviceFeatures;
-    deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
+    deviceCreateInfo.enabledExtensionCount = headless ? 0 : static_cast<uint32_t>(deviceExtensions.size());
     deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
     if (ENABLE_VALIDATION_LAYERS) {
         deviceCreateInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -323,13 +483,7 @@ void VulkanEngine::createSwapChain() {
             break;
         }
     }
-    VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
-    for (const auto& availablePresentMode : swapChainSupport.presentModes) {
-        if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
-            presentMode = availablePresentMode;
-            break;
-        }
-    }
+    VkPresentModeKHR presentMode = pacer.choosePresentMode(swapChainSupport.presentModes);
 
     if (swapChainSupport.capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
         swapChainExtent = swapChainSupport.capabilities.currentExtent;
@@ -408,7 +562,7 @@ void VulkanEngine::createRenderPass() {
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -481,8 +635,8 @@ void VulkanEngine::createGraphicsPipeline() {
 
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescriptions();
+    auto bindingDescription = GpuVertex::getBindingDescription();
+    auto attributeDescriptions = GpuVertex::getAttributeDescriptions();
     vertexInputInfo.vertexBindingDescriptionCount = 1;
     vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
     vertexInputInfo.vertexAttributeDescriptionCount = static_cast< uint32_t >(attributeDescriptions.size());
@@ -617,51 +771,94 @@ void VulkanEngine::createDepthResources() {
     depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
 }
 
-void VulkanEngine::createVertexBuffer() {
-    VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-    void* data;
-    vkMapMemory(vulkanDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, vertices.data(), (size_t) bufferSize);
-    vkUnmapMemory(vulkanDevice, stagingBufferMemory);
-
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
-
-    copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-
-    vkDestroyBuffer(vulkanDevice, stagingBuffer, nullptr);
-    vkFreeMemory(vulkanDevice, stagingBufferMemory, nullptr);
+// Пишет вершины (упакованные прямо на месте) и индексы в отображённую память
+void VulkanEngine::writeGeometry(void* vertexData, void* indexData) {
+#ifdef PACKED_VERTEX
+    if (cached.vertices == nullptr) {
+        auto packed = static_cast<PackedVertex*>(vertexData);
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            packed[i] = PackedVertex::pack(vertices[i]);
+        }
+    } else {
+        memcpy(vertexData, cached.vertices, sizeof(GpuVertex) * vertexCount());
+    }
+#else
+    memcpy(vertexData, cached.vertices != nullptr ? cached.vertices : vertices.data(), sizeof(GpuVertex) * vertexCount());
+#endif
+    memcpy(indexData, cached.indices != nullptr ? cached.indices : indices.data(), sizeof(uint32_t) * indexCount());
 }
 
-void VulkanEngine::createIndexBuffer() {
-    VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+// Буферы вершин и индексов. Если у устройства есть видимая процессору локальная память (UMA, Resizable BAR), сетка пишется прямо в неё.
+// Иначе оба буфера заполняются через один промежуточный буфер одной отправкой с ожиданием забора
+void VulkanEngine::createGeometryBuffers() {
+    VkDeviceSize vertexSize = sizeof(GpuVertex) * vertexCount();
+    VkDeviceSize indexSize = sizeof(uint32_t) * indexCount();
+    const VkMemoryPropertyFlags hostVisible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (streamer != nullptr) {
+        vertexSize += sizeof(GpuVertex) * TileStreamer::MAX_VERTICES * streamSlots.size();
+        indexSize += sizeof(uint32_t) * TileStreamer::MAX_INDICES * streamSlots.size();
+        createBuffer(vertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, hostVisible, vertexBuffer, vertexBufferMemory);
+        createBuffer(indexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, hostVisible, indexBuffer, indexBufferMemory);
+        vertexBufferMapped = vertexBufferMemory.mapped;
+        indexBufferMapped = indexBufferMemory.mapped;
+        writeGeometry(vertexBufferMapped, indexBufferMapped);
+        return;
+    }
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+    if (tryCreateBuffer(vertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | hostVisible, vertexBuffer, vertexBufferMemory)) {
+        if (tryCreateBuffer(indexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | hostVisible, indexBuffer, indexBufferMemory)) {
+            writeGeometry(vertexBufferMemory.mapped, indexBufferMemory.mapped);
+            std::cout << "geometry upload: direct to device-local host-visible memory" << std::endl;
+            return;
+        }
+        vkDestroyBuffer(vulkanDevice, vertexBuffer, nullptr);
+        allocator.free(vertexBufferMemory);
+    }
 
-    void* data;
-    vkMapMemory(vulkanDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, indices.data(), (size_t) bufferSize);
-    vkUnmapMemory(vulkanDevice, stagingBufferMemory);
+    VkBuffer stagingBuffer;
+    GpuAllocation stagingBufferMemory;
+    createBuffer(vertexSize + indexSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, hostVisible, stagingBuffer, stagingBufferMemory);
+    writeGeometry(stagingBufferMemory.mapped, static_cast<uint8_t*>(stagingBufferMemory.mapped) + vertexSize);
 
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
+    createBuffer(vertexSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+    createBuffer(indexSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
 
-    copyBuffer(stagingBuffer, indexBuffer, bufferSize);
+    copyBuffers(stagingBuffer, { { vertexBuffer, { 0, 0, vertexSize } }, { indexBuffer, { vertexSize, 0, indexSize } } });
 
     vkDestroyBuffer(vulkanDevice, stagingBuffer, nullptr);
-    vkFreeMemory(vulkanDevice, stagingBufferMemory, nullptr);
+    allocator.free(stagingBufferMemory);
+    std::cout << "geometry upload: one staging copy" << std::endl;
+}
+
+void VulkanEngine::createIndirectBuffers() {
+    VkDeviceSize bufferSize = drawCommandCount() * sizeof(VkDrawIndexedIndirectCommand);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    multiDrawIndirect = multiDrawIndirect && properties.limits.maxDrawIndirectCount >= drawCommandCount();
+    indirectBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    indirectBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    indirectBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        createBuffer(bufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, indirectBuffers[i], indirectBuffersMemory[i]);
+        indirectBuffersMapped[i] = indirectBuffersMemory[i].mapped;
+    }
+    std::map<uint32_t, std::vector<uint32_t>> grid;
+    for (uint32_t i = 0; i < chunks.size(); ++i) {
+        grid[chunks[i].grid].push_back(i);
+    }
+    gridChunks.clear();
+    for (auto& [cell, levels] : grid) {
+        std::sort(levels.begin(), levels.end(), [&](uint32_t a, uint32_t b) { return chunks[a].lod < chunks[b].lod; });
+        gridChunks.push_back(std::move(levels));
+    }
+    std::cout << "terrain chunks: " << chunks.size() << " in " << gridChunks.size() << " cells, " << streamSlots.size() << " tile slots, " << (multiDrawIndirect ? "multi-draw indirect" : "one indirect draw per chunk") << std::endl;
 }
 
 void VulkanEngine::createUniformBuffers() {
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         for (size_t k = 0; k < ubo.size(); ++k) {
             createBuffer(ubo[k].size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ubo[k].uniformBuffers[i], ubo[k].uniformBuffersMemory[i]);    
-            vkMapMemory(vulkanDevice, ubo[k].uniformBuffersMemory[i], 0, ubo[k].size, 0, &ubo[k].uniformBuffersMapped[i]);
+            ubo[k].uniformBuffersMapped[i] = ubo[k].uniformBuffersMemory[i].mapped;
         }
     }
 }
@@ -711,7 +908,14 @@ void VulkanEngine::createDescriptorSets() {
     }
 }
 
-void VulkanEngine::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+void VulkanEngine::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, GpuAllocation& bufferMemory) {
+    if (!tryCreateBuffer(size, usage, properties, buffer, bufferMemory)) {
+        throw std::runtime_error("failed to allocate buffer memory!");
+    }
+}
+
+// false, если подходящего типа памяти нет или его кучи исчерпаны; буфер тогда не создаётся
+bool VulkanEngine::tryCreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, GpuAllocation& bufferMemory) {
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
@@ -722,17 +926,17 @@ void VulkanEngine::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkM
     }
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(vulkanDevice, buffer, &memRequirements);
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-    if (vkAllocateMemory(vulkanDevice, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate buffer memory!");
+    bufferMemory = allocator.tryAllocate(memRequirements, properties, true);
+    if (bufferMemory.memory == VK_NULL_HANDLE) {
+        vkDestroyBuffer(vulkanDevice, buffer, nullptr);
+        return false;
     }
-    vkBindBufferMemory(vulkanDevice, buffer, bufferMemory, 0);
+    vkBindBufferMemory(vulkanDevice, buffer, bufferMemory.memory, bufferMemory.offset);
+    return true;
 }
 
-void VulkanEngine::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+// Все копирования из srcBuffer в одном командном буфере и одной отправке; ждёт забор, а не простоя всей очереди
+void VulkanEngine::copyBuffers(VkBuffer srcBuffer, const std::vector<std::pair<VkBuffer, VkBufferCopy>>& copies) {
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
@@ -748,34 +952,33 @@ void VulkanEngine::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSi
 
     vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-        VkBufferCopy copyRegion{};
-        copyRegion.size = size;
-        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+        for (const auto& [dstBuffer, copyRegion] : copies) {
+            vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+        }
 
     vkEndCommandBuffer(commandBuffer);
 
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence;
+    if (vkCreateFence(vulkanDevice, &fenceInfo, nullptr, &fence) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create upload fence!");
+    }
+
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &commandBuffer;
 
-    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphicsQueue);
+    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, fence) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to submit buffer upload!");
+    }
+    vkWaitForFences(vulkanDevice, 1, &fence, VK_TRUE, UINT64_MAX);
 
+    vkDestroyFence(vulkanDevice, fence, nullptr);
     vkFreeCommandBuffers(vulkanDevice, commandPool, 1, &commandBuffer);
 }
 
-uint32_t VulkanEngine::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-        if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-            return i;
-        }
-    }
-    throw std::runtime_error("Failed to find suitable memory type!");
-}
-
 void VulkanEngine::createCommandBuffer() {
     commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
     VkCommandBufferAllocateInfo commandBufferInfo{};
@@ -809,7 +1012,140 @@ void VulkanEngine::createSyncObjects() {
 
 }
 
-void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+void VulkanEngine::createOffscreenTarget() {
+    swapChainExtent = { WIDTH.load(), HEIGHT.load() };
+    swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB; // тот же формат, что обычно выбирается для swapchain
+    swapChainImages.resize(1);
+    createImage(swapChainExtent.width, swapChainExtent.height, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapChainImages[0], offscreenImageMemory);
+}
+
+void VulkanEngine::createTimestampPool() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    if (!properties.limits.timestampComputeAndGraphics) {
+        std::cout << "GPU timestamps are not supported, gpu time is not profiled" << std::endl;
+        return;
+    }
+    timestampPeriod = properties.limits.timestampPeriod;
+    VkQueryPoolCreateInfo queryPoolInfo{};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+    if (vkCreateQueryPool(vulkanDevice, &queryPoolInfo, nullptr, &timestampPool) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create timestamp query pool!");
+    }
+}
+
+// Время render pass кадра из слота frame в мс; вызывать после ожидания его fence
+double VulkanEngine::readGpuTime(uint32_t frame) {
+    if (timestampPool == VK_NULL_HANDLE) {
+        return 0;
+    }
+    uint64_t ticks[2] = { 0, 0 };
+    if (vkGetQueryPoolResults(vulkanDevice, timestampPool, 2 * frame, 2, sizeof(ticks), ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+        return 0;
+    }
+    return (ticks[1] - ticks[0]) * static_cast< double >(timestampPeriod) / 1e6;
+}
+
+// Отдаёт профилировщику GPU-время кадра, который последним прошёл через слот frame
+void VulkanEngine::collectGpuTime(uint32_t frame) {
+    if (submittedFrames[frame] >= 0 && timestampPool != VK_NULL_HANDLE) {
+        profiler.setGpuTime(static_cast< uint64_t >(submittedFrames[frame]), readGpuTime(frame));
+        submittedFrames[frame] = -1;
+    }
+}
+
+// Копирует offscreen-картинку (после render pass она в TRANSFER_SRC_OPTIMAL) в буфер и пишет бинарный PPM
+void VulkanEngine::dumpOffscreen(const std::string& path) {
+    VkDeviceSize bufferSize = static_cast< VkDeviceSize >(swapChainExtent.width) * swapChainExtent.height * 4;
+    VkBuffer readbackBuffer;
+    GpuAllocation readbackBufferMemory;
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, readbackBuffer, readbackBufferMemory);
+
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = commandPool;
+    allocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(vulkanDevice, &allocInfo, &commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        VkBufferImageCopy region{};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[0], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer, 1, &region);
+
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(graphicsQueue);
+
+    vkFreeCommandBuffers(vulkanDevice, commandPool, 1, &commandBuffer);
+
+    const uint8_t* pixels = static_cast< const uint8_t* >(readbackBufferMemory.mapped);
+    std::vector< uint8_t > rgb(static_cast< size_t >(swapChainExtent.width) * swapChainExtent.height * 3);
+    for (size_t i = 0; i < rgb.size() / 3; ++i) { // BGRA -> RGB
+        rgb[3 * i] = pixels[4 * i + 2];
+        rgb[3 * i + 1] = pixels[4 * i + 1];
+        rgb[3 * i + 2] = pixels[4 * i];
+    }
+    vkDestroyBuffer(vulkanDevice, readbackBuffer, nullptr);
+    allocator.free(readbackBufferMemory);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    file << "P6\n" << swapChainExtent.width << " " << swapChainExtent.height << "\n255\n";
+    file.write(reinterpret_cast< const char* >(rgb.data()), rgb.size());
+    std::cout << "last frame saved to " << path << std::endl;
+}
+
+// Заранее записанный буфер на каждую пару (картинка swapchain, кадр в полёте): меняются только данные uniform-буферов
+void VulkanEngine::createStaticCommandBuffers() {
+    staticCommandBuffers.resize(swapChainFramebuffers.size() * MAX_FRAMES_IN_FLIGHT);
+    VkCommandBufferAllocateInfo commandBufferInfo{};
+    commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferInfo.commandPool = commandPool;
+    commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferInfo.commandBufferCount = static_cast< uint32_t >(staticCommandBuffers.size());
+    if (vkAllocateCommandBuffers(vulkanDevice, &commandBufferInfo, staticCommandBuffers.data()) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to allocate static command buffers!");
+    }
+    for (uint32_t image = 0; image < swapChainFramebuffers.size(); ++image) {
+        for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+            recordCommandBuffer(staticCommandBuffers[image * MAX_FRAMES_IN_FLIGHT + frame], image, frame);
+        }
+    }
+}
+
+// Буфер для отправки: заранее записанный или перезаписанный для текущего кадра
+VkCommandBuffer VulkanEngine::frameCommandBuffer(uint32_t imageIndex) {
+    if (!staticCommandBuffers.empty()) {
+        return staticCommandBuffers[imageIndex * MAX_FRAMES_IN_FLIGHT + currentFrame];
+    }
+    auto scope = profiler.scope(FrameProfiler::RECORD);
+    vkResetCommandBuffer(commandBuffers[currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
+    recordCommandBuffer(commandBuffers[currentFrame], imageIndex, currentFrame);
+    return commandBuffers[currentFrame];
+}
+
+void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame) {
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
@@ -830,6 +1166,10 @@ void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t i
     renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
     renderPassInfo.pClearValues = clearValues.data();
 
+    if (timestampPool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(commandBuffer, timestampPool, 2 * frame, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, 2 * frame);
+    }
     vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
@@ -853,14 +1193,25 @@ void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t i
         vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
         vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0,
-            static_cast<uint32_t>(descriptorSets[currentFrame].size()), descriptorSets[currentFrame].data(), 0, nullptr);
-
-        vkCmdDrawIndexed(commandBuffer, static_cast< uint32_t >(indices.size()), 1, 0, 0, 0);
+            static_cast<uint32_t>(descriptorSets[frame].size()), descriptorSets[frame].data(), 0, nullptr);
+
+        // Набор команд постоянный, отсечение меняет только их содержимое, поэтому буфер можно записать заранее
+        uint32_t drawCount = drawCommandCount();
+        if (multiDrawIndirect) {
+            vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffers[frame], 0, drawCount, sizeof(VkDrawIndexedIndirectCommand));
+        } else {
+            for (uint32_t i = 0; i < drawCount; ++i) {
+                vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffers[frame], i * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+            }
+        }
 
 
         // vkCmdDraw(commandBuffer, vertices.size(), 1, 0, 0);
 
     vkCmdEndRenderPass(commandBuffer);
+    if (timestampPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, 2 * frame + 1);
+    }
 
     if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
@@ -870,20 +1221,26 @@ void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t i
 void VulkanEngine::recreateSwapChain() {
     windowVisible = false;
     std::unique_lock lock(windowMutex);
-    windowCv.wait(lock, [this] { return windowVisible.load(); });
+    windowCv.wait(lock, [this] { return windowVisible || !running; });
+    if (!running) {
+        return;
+    }
     vkDeviceWaitIdle(vulkanDevice);
     cleanupSwapChain();
     createSwapChain();
     createImageViews();
     createDepthResources();
     createFramebuffers();
+    if (prerecordCommands) {
+        createStaticCommandBuffers();
+    }
 }
 
 bool VulkanEngine::validPath(Point a, Point b, float h) {
     double vecX = (b.x - a.x) / 100; 
     double vecY = (b.x - a.x) / 100;
     for (int i = 1; i <= 100; ++i) {
-        auto th = 1 - perlin.noise(std::max(0.0, (a.x + vecX + 1.0) * MAP_WIDTH / 2 / 64), std::max(0.0, (a.y + vecY + 1.0) * MAP_HEIGHT / 2 / 64), 3);
+        auto th = terrainHeight(a.x + vecX, a.y + vecY);
         if (th < h) {
             return false;
         }
@@ -891,8 +1248,8 @@ bool VulkanEngine::validPath(Point a, Point b, float h) {
     return true;
 }
 
-void VulkanEngine::updateUniformBuffer(uint32_t currentImage) {
-    static auto initialFH = 1 - perlin.noise(MAP_WIDTH / 2 / 64.0f, MAP_HEIGHT / 2 / 64.0f, 3);
+void VulkanEngine::updateUniformBuffer(uint32_t currentImage, float steps) {
+    static auto initialFH = terrainHeight(0, 0);
     static auto prevFH = initialFH;
     // static auto startTime = std::chrono::high_resolution_clock::now();
     // static auto prevTime = std::chrono::high_resolution_clock::now();
@@ -900,16 +1257,16 @@ void VulkanEngine::updateUniformBuffer(uint32_t currentImage) {
 
     static std::shared_ptr<Point> semi = nullptr;
 
-    mvp.model = glm::translate(mvp.model, glm::vec3(-moveX.load() / 500, -moveY.load() / 500, -moveZ.load() / 100));
+    mvp.model = glm::translate(mvp.model, glm::vec3(-moveX.load() / 500 * steps, -moveY.load() / 500 * steps, -moveZ.load() / 100));
 
     //glm::rotate(glm::mat4(1), static_cast<float>(M_PI / 2.0f), glm::vec3(0, 1, 0));
     moveZ = 0;    
     glm::mat4 mv = mvp.view * mvp.model;
     if (finishMoveX != 0 || finishMoveY != 0) {
         semi = nullptr;
-        finishModel = glm::translate(finishModel, glm::vec3(finishMoveX.load() / 500, finishMoveY.load() / 500, 0));
+        finishModel = glm::translate(finishModel, glm::vec3(finishMoveX.load() / 500 * steps, finishMoveY.load() / 500 * steps, 0));
         glm::vec3 fPos = glm::vec3(finishModel * glm::vec4(0, 0, initialFH, 1));
-        auto curFH = 1 - perlin.noise(std::max(0.0f, (fPos.x + 1) * MAP_WIDTH / 2 / 64), std::max(0.0f, (fPos.y + 1) * MAP_HEIGHT / 2 / 64), 3);
+        auto curFH = terrainHeight(fPos.x, fPos.y);
         finishX = fPos.x;
         finishY = fPos.y;
         finishModel = glm::translate(finishModel, glm::vec3(0, 0, curFH - prevFH));
@@ -921,7 +1278,7 @@ void VulkanEngine::updateUniformBuffer(uint32_t currentImage) {
     glm::vec3 v = glm::vec3(fx - planeCords.x, fy - planeCords.y, 0);
 
     glm::mat4 pm;
-    if (v.x * v.x + v.y * v.y < 0.000001) {
+    if (v.x * v.x + v.y * v.y < 0.000001 * steps * steps) { // ближе одного шага - встаёт на финиш, а не перелетает его
         planeModel = glm::translate(planeModel, glm::vec3(v.x, v.y, 0));
         pm = glm::rotate(planeModel, static_cast<float>(M_PI_2), {-1, 0, 0}), std::acos(glm::dot(glm::normalize(v), {1, 0, 0}));
     } else {
@@ -929,7 +1286,7 @@ void VulkanEngine::updateUniformBuffer(uint32_t currentImage) {
         
         float maxH = 1;
         for (int i = 0; i < 100; ++i) {
-            auto next = 1 - perlin.noise(std::max(0.0f, (planeCords.x + v.x * i + 1) * MAP_WIDTH / 2 / 64), std::max(0.0f, (planeCords.y + v.y * i + 1) * MAP_HEIGHT / 2 / 64), 3);
+            auto next = terrainHeight(planeCords.x + v.x * i, planeCords.y + v.y * i);
             if (next < maxH) {
                 maxH = next;
             }
@@ -941,7 +1298,7 @@ void VulkanEngine::updateUniformBuffer(uint32_t currentImage) {
         } else if (planeCords.z < 0.4) {
             v.z = 0.0001;
         }
-        planeModel = glm::translate(planeModel, glm::vec3(v.x, v.y, v.z));
+        planeModel = glm::translate(planeModel, glm::vec3(v.x, v.y, v.z) * steps);
         float angle = std::acos(glm::dot(glm::normalize(glm::vec2(v)), {1, 0}));
         pm = glm::rotate(glm::rotate(planeModel, static_cast<float>(M_PI_2), {-1, 0, 0}), angle, {0, v.y < 0 ? 1 : -1, 0});
     }
@@ -953,27 +1310,153 @@ void VulkanEngine::updateUniformBuffer(uint32_t currentImage) {
     memcpy(ubo[1].uniformBuffersMapped[currentImage], &light, ubo[1].size);
 }
 
+size_t VulkanEngine::vertexCount() const {
+    return cached.vertices != nullptr ? cached.vertexCount : vertices.size();
+}
+
+size_t VulkanEngine::indexCount() const {
+    return cached.indices != nullptr ? cached.indexCount : indices.size();
+}
+
+// Чанки, места плиток и последняя команда для остальных объектов
+uint32_t VulkanEngine::drawCommandCount() const {
+    return static_cast< uint32_t >(chunks.size() + streamSlots.size()) + 1;
+}
+
+// Потоковая карта: места ушедших из радиуса плиток освобождаются, готовые плитки копируются в свободные места
+void VulkanEngine::streamTiles() {
+    if (streamer == nullptr) return;
+    ++streamFrame;
+    glm::vec4 focus = glm::inverse(mvp.model) * glm::vec4(0, 0, 0, 1); // точка, на которую смотрит камера
+    streamer->setFocus(focus.x, focus.y);
+    for (StreamSlot& slot : streamSlots) {
+        if (slot.used && !streamer->inRange(slot.x, slot.y)) {
+            slot.used = false;
+            slot.freedAt = streamFrame;
+            streamer->release(slot.x, slot.y);
+        }
+    }
+    std::vector<std::shared_ptr<const StreamedTile>> ready = streamer->takeReady();
+    pendingTiles.insert(pendingTiles.end(), ready.begin(), ready.end());
+    std::vector<std::shared_ptr<const StreamedTile>> waiting;
+    size_t free = 0;
+    for (const std::shared_ptr<const StreamedTile>& tile : pendingTiles) {
+        if (!streamer->inRange(tile->x, tile->y)) {
+            streamer->release(tile->x, tile->y);
+            continue;
+        }
+        while (free < streamSlots.size() && (streamSlots[free].used || streamSlots[free].freedAt + MAX_FRAMES_IN_FLIGHT > streamFrame)) {
+            ++free;
+        }
+        if (free == streamSlots.size()) {
+            waiting.push_back(tile);
+            continue;
+        }
+        StreamSlot& slot = streamSlots[free];
+        auto gpuVertices = static_cast<GpuVertex*>(vertexBufferMapped) + vertexCount() + free * TileStreamer::MAX_VERTICES;
+#ifdef PACKED_VERTEX
+        // Упакованная позиция ограничена ±POSITION_SCALE, плитки дальше от начала координат в этом формате искажаются
+        for (size_t i = 0; i < tile->vertices.size(); ++i) {
+            gpuVertices[i] = PackedVertex::pack(tile->vertices[i]);
+        }
+#else
+        memcpy(gpuVertices, tile->vertices.data(), tile->vertices.size() * sizeof(Vertex));
+#endif
+        memcpy(static_cast<uint32_t*>(indexBufferMapped) + indexCount() + free * TileStreamer::MAX_INDICES, tile->indices.data(), tile->indices.size() * sizeof(uint32_t));
+        slot.x = tile->x;
+        slot.y = tile->y;
+        slot.used = true;
+        slot.indexCount = static_cast<uint32_t>(tile->indices.size());
+        slot.min = tile->min;
+        slot.max = tile->max;
+    }
+    pendingTiles = std::move(waiting);
+}
+
+// Конец индексов рельефа: чанки лежат подряд с начала буфера
+uint32_t VulkanEngine::terrainIndexCount() const {
+    uint32_t end = 0;
+    for (const TerrainChunk& chunk : chunks) {
+        end = std::max(end, chunk.firstIndex + chunk.indexCount);
+    }
+    return end;
+}
+
+// Видимые чанки записываются в начало indirect-буфера кадра, остальные команды обнуляются; последняя команда - самолёт и финиш.
+// В каждой клетке сетки берётся самый грубый уровень, ошибка которого на экране не больше lodPixelError.
+// Возвращает число треугольников к отрисовке
+uint64_t VulkanEngine::cullChunks(uint32_t frame) {
+    auto commands = static_cast< VkDrawIndexedIndirectCommand* >(indirectBuffersMapped[frame]);
+    Frustum frustum(mvp.projection * mvp.view * mvp.model);
+    glm::vec4 eye = glm::inverse(mvp.view * mvp.model) * glm::vec4(0, 0, 0, 1);
+    float pixelsPerUnit = mvp.projection[1][1] * swapChainExtent.height / 2; // на единичном расстоянии
+    uint32_t visible = 0;
+    uint64_t triangles = 0;
+    for (const std::vector<uint32_t>& levels : gridChunks) {
+        const TerrainChunk* chosen = &chunks[levels[0]];
+        if (levels.size() > 1) {
+            const TerrainChunk& finest = chunks[levels[0]];
+            glm::vec3 nearest(std::clamp(eye.x, finest.min.x, finest.max.x), std::clamp(eye.y, finest.min.y, finest.max.y), std::clamp(eye.z, finest.min.z, finest.max.z));
+            glm::vec3 offset(eye.x - nearest.x, eye.y - nearest.y, eye.z - nearest.z);
+            float distance = std::max(std::sqrt(offset.x * offset.x + offset.y * offset.y + offset.z * offset.z), 1e-4f);
+            for (size_t k = levels.size() - 1; k > 0; --k) {
+                if (chunks[levels[k]].error * pixelsPerUnit / distance <= lodPixelError) {
+                    chosen = &chunks[levels[k]];
+                    break;
+                }
+            }
+        }
+        const TerrainChunk& chunk = *chosen;
+        if (!frustumCulling || frustum.intersects(chunk.min, chunk.max)) {
+            commands[visible++] = { chunk.indexCount, 1, chunk.firstIndex, 0, 0 };
+            triangles += chunk.indexCount / 3;
+        }
+    }
+    for (size_t k = 0; k < streamSlots.size(); ++k) {
+        const StreamSlot& slot = streamSlots[k];
+        if (slot.used && (!frustumCulling || frustum.intersects(slot.min, slot.max))) {
+            uint32_t firstIndex = static_cast< uint32_t >(indexCount() + k * TileStreamer::MAX_INDICES);
+            int32_t vertexOffset = static_cast< int32_t >(vertexCount() + k * TileStreamer::MAX_VERTICES);
+            commands[visible++] = { slot.indexCount, 1, firstIndex, vertexOffset, 0 };
+            triangles += slot.indexCount / 3;
+        }
+    }
+    uint32_t last = drawCommandCount() - 1;
+    for (size_t i = visible; i < last; ++i) {
+        commands[i] = { 0, 0, 0, 0, 0 };
+    }
+    uint32_t terrainEnd = terrainIndexCount();
+    uint32_t restCount = static_cast< uint32_t >(indexCount()) - terrainEnd;
+    commands[last] = { restCount, 1, terrainEnd, 0, 0 };
+    return triangles + restCount / 3;
+}
+
 void VulkanEngine::drawFrame() {
     static uint32_t fps = 0;
     static auto lastSecondTime = std::chrono::high_resolution_clock::now();
-    static auto prevFrameTime = std::chrono::high_resolution_clock::now();
     auto currentSecondTime = std::chrono::high_resolution_clock::now();
 
     if (std::chrono::duration<float, std::chrono::milliseconds::period>(currentSecondTime - lastSecondTime).count() >= 1000) {
         lastSecondTime = currentSecondTime;
-        std::cout << fps << std::endl;
+        std::cout << fps << " fps, ";
+        profiler.report(std::cout);
+        std::cout << std::endl;
         fps = 0;
     }
-    if (std::chrono::duration<float, std::chrono::milliseconds::period>(currentSecondTime - prevFrameTime).count() < 6) {
-        return;
-    }
-    prevFrameTime = currentSecondTime;
-    
     fps++;
-    vkWaitForFences(vulkanDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+    uint64_t profiledFrame = profiler.beginFrame();
+    {
+        auto scope = profiler.scope(FrameProfiler::FENCE_WAIT);
+        vkWaitForFences(vulkanDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+    }
+    collectGpuTime(currentFrame);
 
     uint32_t imageIndex;
-    VkResult result = vkAcquireNextImageKHR(vulkanDevice, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    VkResult result;
+    {
+        auto scope = profiler.scope(FrameProfiler::ACQUIRE);
+        result = vkAcquireNextImageKHR(vulkanDevice, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    }
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
         recreateSwapChain();
@@ -982,12 +1465,26 @@ void VulkanEngine::drawFrame() {
         throw std::runtime_error("Failed to acquire swap chain image");
     }
 
-    updateUniformBuffer(currentFrame);
+    {
+        auto scope = profiler.scope(FrameProfiler::UPDATE);
+        static auto lastUpdateTime = std::chrono::steady_clock::now();
+        auto updateTime = std::chrono::steady_clock::now();
+        float steps = std::chrono::duration< float, std::milli >(updateTime - lastUpdateTime).count() / UPDATE_STEP_MS;
+        lastUpdateTime = updateTime;
+        updateUniformBuffer(currentFrame, std::min(steps, MAX_UPDATE_STEPS));
+    }
+    {
+        auto scope = profiler.scope(FrameProfiler::STREAM);
+        streamTiles();
+    }
+    {
+        auto scope = profiler.scope(FrameProfiler::CULL);
+        profiler.setTriangles(cullChunks(currentFrame));
+    }
 
     vkResetFences(vulkanDevice, 1, &inFlightFences[currentFrame]);
 
-    vkResetCommandBuffer(commandBuffers[currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
-    recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+    VkCommandBuffer commandBuffer = frameCommandBuffer(imageIndex);
 
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -999,15 +1496,19 @@ void VulkanEngine::drawFrame() {
     submitInfo.pWaitDstStageMask = waitStages;
 
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+    submitInfo.pCommandBuffers = &commandBuffer;
 
     VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
     submitInfo.signalSemaphoreCount = 1;
     submitInfo.pSignalSemaphores = signalSemaphores;
 
-    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
-        throw std::runtime_error("Failed to submit draw command buffer!");
+    {
+        auto scope = profiler.scope(FrameProfiler::SUBMIT);
+        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit draw command buffer!");
+        }
     }
+    submittedFrames[currentFrame] = static_cast< int64_t >(profiledFrame);
 
     VkPresentInfoKHR presentInfo{};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1021,7 +1522,10 @@ void VulkanEngine::drawFrame() {
 
     presentInfo.pImageIndices = &imageIndex;
 
-    result = vkQueuePresentKHR(presentQueue, &presentInfo);
+    {
+        auto scope = profiler.scope(FrameProfiler::PRESENT);
+        result = vkQueuePresentKHR(presentQueue, &presentInfo);
+    }
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
         recreateSwapChain();
@@ -1031,7 +1535,7 @@ void VulkanEngine::drawFrame() {
     currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
 }
 
-void VulkanEngine::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+void VulkanEngine::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, GpuAllocation& imageMemory) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1052,14 +1556,8 @@ void VulkanEngine::createImage(uint32_t width, uint32_t height, VkFormat format,
     VkMemoryRequirements memRequirements;
     vkGetImageMemoryRequirements(vulkanDevice, image, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-    if (vkAllocateMemory(vulkanDevice, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate image memory!");
-    }
-    vkBindImageMemory(vulkanDevice, image, imageMemory, 0);
+    imageMemory = allocator.allocate(memRequirements, properties, tiling == VK_IMAGE_TILING_LINEAR);
+    vkBindImageMemory(vulkanDevice, image, imageMemory.memory, imageMemory.offset);
 }
 
 VkImageView VulkanEngine::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags) {
@@ -1129,7 +1627,11 @@ QueueFamilyIndices VulkanEngine::findQueueFamilies(const VkPhysicalDevice& devic
             indices.graphicsFamily = i;
         }
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+        if (headless) {
+            presentSupport = (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        } else {
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+        }
         if (presentSupport) {
             indices.presentFamily = i;
         }
@@ -1159,6 +1661,13 @@ SwapChainSupportDetails VulkanEngine::querySwapChainSupport(const VkPhysicalDevi
 }
 
 std::vector<const char*> VulkanEngine::getRequiredExtensions() {
+    if (headless) {
+        std::vector< const char* > extensions;
+        if (ENABLE_VALIDATION_LAYERS) {
+            extensions.emplace_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+        }
+        return extensions;
+    }
     uint32_t extCount = 0;
 	if (!SDL_Vulkan_GetInstanceExtensions(window, &extCount, nullptr)) {
         throw std::runtime_error("Unable to query Vulkan instance extensions");
@@ -15,8 +15,18 @@
 #include <vector>
 #include <array>
 #include <fstream>
+#include <string>
 #include <optional>
-
+#include <memory>
+#include <cmath>
+#include <cstdint>
+
+#include "frame_pacer.h"
+#include "frame_profiler.h"
+#include "frustum.h"
+#include "gpu_allocator.h"
+#include "height_field.h"
+#include "map_tile.h"
 #include "perlin_noise_2d.h"
 
 #ifdef NDEBUG
@@ -62,7 +72,7 @@ struct LightInfo {
 struct UniformBufferObject {
     VkDeviceSize size;
     std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBuffersMemory;
+    std::vector<GpuAllocation> uniformBuffersMemory;
     std::vector<void*> uniformBuffersMapped;
 };
 
@@ -106,14 +116,157 @@ struct Vertex {
     }
 };
 
+// Упакованная вершина, 16 байт вместо 52: позиция snorm16 с масштабом POSITION_SCALE, нормаль в октаэдрическом
+// кодировании snorm16, номер цвета в палитре, номер объекта (бывший pos.w) и маска outline. Раскодируется в shader.vert.
+struct PackedVertex {
+    static constexpr float POSITION_SCALE = 4.0f;
+
+    int16_t pos[4];
+    uint8_t palette;
+    uint8_t object;
+    uint8_t outline;
+    uint8_t padding;
+    int16_t normal[2];
+
+    // Цвета MapTile::getColor, затем красный и белый самолёта и синий флажок; порядок совпадает с PALETTE в shader.vert
+    static const std::array< glm::vec3, 8 >& getPalette() {
+        static const std::array< glm::vec3, 8 > palette = {
+            MapTile::getColor(MapTile::WATER), MapTile::getColor(MapTile::SHORE), MapTile::getColor(MapTile::PLAIN),
+            MapTile::getColor(MapTile::MOUNTAIN), MapTile::getColor(MapTile::HIGH_MOUNTAIN),
+            glm::vec3(1, 0, 0), glm::vec3(1, 1, 1), glm::vec3(0, 0, 1)
+        };
+        return palette;
+    }
+
+    static PackedVertex pack(const Vertex& vertex) {
+        PackedVertex packed{};
+        for (int k = 0; k < 3; ++k) {
+            packed.pos[k] = toSnorm16(vertex.pos[k] / POSITION_SCALE);
+        }
+        glm::vec2 oct = octEncode(vertex.normal);
+        packed.normal[0] = toSnorm16(oct.x);
+        packed.normal[1] = toSnorm16(oct.y);
+        packed.palette = paletteIndex(vertex.color);
+        packed.object = static_cast< uint8_t >(vertex.pos.w);
+        packed.outline = (vertex.outline.x > 0.5f) | (vertex.outline.y > 0.5f) << 1 | (vertex.outline.z > 0.5f) << 2;
+        return packed;
+    }
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(PackedVertex);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return bindingDescription;
+    }
+
+    static std::array< VkVertexInputAttributeDescription, 3 > getAttributeDescriptions() {
+        std::array< VkVertexInputAttributeDescription, 3 > attributeDescriptions{};
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0;
+        attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_SNORM;
+        attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
+
+        attributeDescriptions[1].binding = 0;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = VK_FORMAT_R8G8B8A8_UINT;
+        attributeDescriptions[1].offset = offsetof(PackedVertex, palette);
+
+        attributeDescriptions[2].binding = 0;
+        attributeDescriptions[2].location = 2;
+        attributeDescriptions[2].format = VK_FORMAT_R16G16_SNORM;
+        attributeDescriptions[2].offset = offsetof(PackedVertex, normal);
+
+        return attributeDescriptions;
+    }
+
+    private:
+        static int16_t toSnorm16(float value) {
+            return static_cast< int16_t >(std::round(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f));
+        }
+
+        // Нормаль не нормирована (сумма нормалей граней), направление сохраняется, длина всё равно нормируется в шейдере
+        static glm::vec2 octEncode(glm::vec3 n) {
+            float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+            if (sum == 0) {
+                return { 0, 0 };
+            }
+            n /= sum;
+            if (n.z < 0) {
+                return { (1 - std::abs(n.y)) * (n.x >= 0 ? 1 : -1), (1 - std::abs(n.x)) * (n.y >= 0 ? 1 : -1) };
+            }
+            return { n.x, n.y };
+        }
+
+        static uint8_t paletteIndex(const glm::vec3& color) {
+            const auto& palette = getPalette();
+            uint8_t best = 0;
+            for (uint8_t i = 1; i < palette.size(); ++i) {
+                glm::vec3 d = palette[i] - color, bestD = palette[best] - color;
+                if (glm::dot(d, d) < glm::dot(bestD, bestD)) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+};
+
+// Участок рельефа: треугольники [firstIndex, firstIndex + indexCount) индексного буфера и их AABB в координатах модели.
+// grid - клетка сетки чанков, lod - уровень детализации (0 - полный), error - размер ячейки уровня в координатах модели
+struct TerrainChunk {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    glm::vec3 min;
+    glm::vec3 max;
+    uint32_t grid = 0;
+    uint32_t lod = 0;
+    float error = 0;
+};
+
+class TileStreamer;
+struct StreamedTile;
+
+static_assert(sizeof(PackedVertex) == 16, "PackedVertex должен занимать 16 байт");
+
+// Формат вершин в видеопамяти выбирается при сборке (опция PACKED_VERTEX в CMakeLists.txt)
+#ifdef PACKED_VERTEX
+using GpuVertex = PackedVertex;
+#else
+using GpuVertex = Vertex;
+#endif
+
+// Готовые буферы в формате видеопамяти, например из отображённого в память кэша карты; движок их не копирует и не освобождает
+struct GpuGeometry {
+    const GpuVertex* vertices = nullptr;
+    size_t vertexCount = 0;
+    const uint32_t* indices = nullptr;
+    size_t indexCount = 0;
+};
+
 class VulkanEngine {
     public:
         PerlinNoise2D& perlin;
         std::vector<Cell*>& cells;
         std::vector<Vertex> vertices;
         std::vector<uint32_t> indices;
+        std::vector<TerrainChunk> chunks; // чанки рельефа в начале indices; всё после них (самолёт, финиш) рисуется всегда
+        bool frustumCulling = true;
+        float lodPixelError = 2; // допустимая ошибка уровня детализации на экране, пикселей
+        HeightField heightField;
+        FrameProfiler profiler; // фазы кадров drawFrame / runHeadless, выгрузка после run()
+        FramePacer pacer; // политика темпа кадров и режим показа swapchain, задаётся до run()
+        bool prerecordCommands = false; // командные буферы записываются один раз и перезаписываются только вместе со swapchain
+        TileStreamer* streamer = nullptr; // потоковая карта вместо chunks, задаётся до run()
+        GpuGeometry cached; // если задано, загружается вместо vertices / indices; память должна жить до конца run()
         void run();
 
+        // Карта высот для запросов высоты рельефа; если не построена заранее, строится в run()
+        void buildHeightField(ThreadPool* pool = nullptr);
+
+        // Без окна: frames кадров в offscreen-картинку по заданному пути камеры, время CPU/GPU по кадрам,
+        // последний кадр при необходимости сохраняется в dumpPath (PPM)
+        void runHeadless(uint32_t frames, const std::string& dumpPath = "");
+
         VulkanEngine(PerlinNoise2D& perlin, std::vector<Cell*>& cells) : perlin(perlin), cells(cells) {};
 
     private:
@@ -125,6 +278,7 @@ class VulkanEngine {
         };
 
         const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+        const uint32_t HEIGHT_FIELD_RESOLUTION = 128; // узлов на единицу координат шума
         std::atomic<uint32_t> WIDTH = 1600;
         std::atomic<uint32_t> HEIGHT = 900;
 
@@ -151,30 +305,34 @@ class VulkanEngine {
 
         uint32_t currentFrame = 0;
 
-        SDL_Window* window;
+        bool headless = false;
+        SDL_Window* window = nullptr;
         std::mutex windowMutex;
         std::condition_variable windowCv;
 
         VkInstance instance;
         VkDebugUtilsMessengerEXT debugMessenger;
-        VkSurfaceKHR surface;
+        VkSurfaceKHR surface = VK_NULL_HANDLE;
 
         VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
         VkDevice vulkanDevice;
+        GpuAllocator allocator; // вся память буферов и изображений
 
         VkQueue graphicsQueue;
         VkQueue presentQueue;
 
-        VkSwapchainKHR swapChain;
+        VkSwapchainKHR swapChain = VK_NULL_HANDLE;
         std::vector<VkImage> swapChainImages;
         VkFormat swapChainImageFormat;
         VkExtent2D swapChainExtent;
         std::vector<VkImageView> swapChainImageViews;
         std::vector<VkFramebuffer> swapChainFramebuffers;
 
+        GpuAllocation offscreenImageMemory; // в headless-режиме вместо swapchain одна своя картинка
+
         VkImage depthImage;
         VkImageView depthImageView;
-        VkDeviceMemory depthImageMemory;
+        GpuAllocation depthImageMemory;
 
         VkRenderPass renderPass;
 
@@ -187,21 +345,49 @@ class VulkanEngine {
 
         VkCommandPool commandPool;
         std::vector< VkCommandBuffer > commandBuffers;
+        std::vector< VkCommandBuffer > staticCommandBuffers; // [картинка * MAX_FRAMES_IN_FLIGHT + кадр], пусто без prerecordCommands
 
         VkBuffer indexBuffer;
-        VkDeviceMemory indexBufferMemory;
+        GpuAllocation indexBufferMemory;
         VkBuffer vertexBuffer;
-        VkDeviceMemory vertexBufferMemory;
+        GpuAllocation vertexBufferMemory;
+
+        // Потоковая карта: буферы вершин и индексов отображены в память, после статической части идут места под плитки.
+        // Освобождённое место занимается не раньше чем через MAX_FRAMES_IN_FLIGHT кадров, пока его могут читать кадры в полёте
+        struct StreamSlot {
+            int32_t x = 0, y = 0;
+            bool used = false;
+            uint64_t freedAt = 0;
+            uint32_t indexCount = 0;
+            glm::vec3 min, max;
+        };
+        std::vector<StreamSlot> streamSlots;
+        std::vector<std::shared_ptr<const StreamedTile>> pendingTiles; // построены, но ждут свободного места
+        uint64_t streamFrame = 0;
+        void* vertexBufferMapped = nullptr;
+        void* indexBufferMapped = nullptr;
+
+        // Команды VkDrawIndexedIndirectCommand на кадр в полёте: по одной на чанк и место плитки и одна на остальные объекты
+        std::vector<VkBuffer> indirectBuffers;
+        std::vector<GpuAllocation> indirectBuffersMemory;
+        std::vector<void*> indirectBuffersMapped;
+        bool multiDrawIndirect = false;
+        // Чанки каждой клетки сетки по возрастанию lod; из них в кадре рисуется один
+        std::vector<std::vector<uint32_t>> gridChunks;
 
         std::vector<UniformBufferObject> ubo { 
-            { sizeof(Matrices), std::vector<VkBuffer>(MAX_FRAMES_IN_FLIGHT), std::vector<VkDeviceMemory>(MAX_FRAMES_IN_FLIGHT), std::vector<void*>(MAX_FRAMES_IN_FLIGHT) },
-            { sizeof(LightInfo), std::vector<VkBuffer>(MAX_FRAMES_IN_FLIGHT), std::vector<VkDeviceMemory>(MAX_FRAMES_IN_FLIGHT), std::vector<void*>(MAX_FRAMES_IN_FLIGHT) }
+            { sizeof(Matrices), std::vector<VkBuffer>(MAX_FRAMES_IN_FLIGHT), std::vector<GpuAllocation>(MAX_FRAMES_IN_FLIGHT), std::vector<void*>(MAX_FRAMES_IN_FLIGHT) },
+            { sizeof(LightInfo), std::vector<VkBuffer>(MAX_FRAMES_IN_FLIGHT), std::vector<GpuAllocation>(MAX_FRAMES_IN_FLIGHT), std::vector<void*>(MAX_FRAMES_IN_FLIGHT) }
         };
 
         std::vector< VkSemaphore > imageAvailableSemaphores;
         std::vector< VkSemaphore > renderFinishedSemaphores;
         std::vector< VkFence > inFlightFences;
 
+        VkQueryPool timestampPool = VK_NULL_HANDLE; // две метки на кадр в полёте: начало и конец render pass
+        float timestampPeriod = 1; // нс на тик
+        std::vector< int64_t > submittedFrames = std::vector< int64_t >(MAX_FRAMES_IN_FLIGHT, -1); // номер кадра профилировщика в слоте, -1 если прочитан
+
         std::atomic< bool > running = true;
         std::atomic< bool > windowVisible = true;
 
@@ -224,31 +410,49 @@ class VulkanEngine {
         void createFramebuffers();
         void createCommandPool();
         void createDepthResources();
-        void createVertexBuffer();
-        void createIndexBuffer();
+        void createGeometryBuffers();
+        void writeGeometry(void* vertexData, void* indexData);
+        void createIndirectBuffers();
         void createUniformBuffers();
         void createDescriptorPool();
         void createDescriptorSets();
         void createCommandBuffer();
         void createSyncObjects();
+        void createOffscreenTarget();
+        void createTimestampPool();
 
-        void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+        void createStaticCommandBuffers();
+        VkCommandBuffer frameCommandBuffer(uint32_t imageIndex);
+        void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame);
         void recreateSwapChain();
         bool validPath(Point a, Point b, float h);
-        void updateUniformBuffer(uint32_t currentImage);
+        float terrainHeight(float x, float y) const;
+        // steps - прошедшее время в шагах UPDATE_STEP_MS: скорость камеры, финиша и самолёта не зависит от частоты кадров
+        void updateUniformBuffer(uint32_t currentImage, float steps = 1);
+        static constexpr float UPDATE_STEP_MS = 6; // шаг, под который подобраны скорости (прежний предел ~166 обновлений в секунду)
+        static constexpr float MAX_UPDATE_STEPS = 16; // после паузы (свёрнутое окно) не прыгать дальше ~100 мс пути
+        uint32_t terrainIndexCount() const;
+        size_t vertexCount() const;
+        size_t indexCount() const;
+        uint32_t drawCommandCount() const;
+        void streamTiles();
+        uint64_t cullChunks(uint32_t frame);
         void drawFrame();
+        double readGpuTime(uint32_t frame);
+        void collectGpuTime(uint32_t frame);
+        void dumpOffscreen(const std::string& path);
 
-        void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, VkDeviceMemory &imageMemory);
+        void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, GpuAllocation &imageMemory);
         VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags);
 
-        void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
-        void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+        void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, GpuAllocation& bufferMemory);
+        bool tryCreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, GpuAllocation& bufferMemory);
+        void copyBuffers(VkBuffer srcBuffer, const std::vector<std::pair<VkBuffer, VkBufferCopy>>& copies);
         
         VkFormat findSupportedFormat(const std::vector<VkFormat>&candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
         VkFormat findDepthFormat();
         bool hasStencilComponent(VkFormat format);
 
-        uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
         VkShaderModule createShaderModule(const std::vector<char> &code);
         QueueFamilyIndices findQueueFamilies(const VkPhysicalDevice &device);
         SwapChainSupportDetails querySwapChainSupport(const VkPhysicalDevice &device);